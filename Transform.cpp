@@ -17,9 +17,12 @@
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Support/Path.h>
 #include <llvm/Support/FileSystem.h>
+#include <llvm/ADT/FoldingSet.h>
 #include <string>
 #include <cctype>
+#include <climits>
 #include <memory>
+#include <algorithm>
 #include "../../lib/Sema/TreeTransform.h"
 
 using namespace clang;
@@ -46,6 +49,24 @@ namespace {
     return (as_identifier + "_" + llvm::Twine(seed)).str();
   }
 
+  // Options that control the translation, set from the
+  // command line by main.
+  struct UPCTransformOptions {
+    UPCTransformOptions() : StaticThreads(0), NonBlockingGets(false), DeferredPuts(false), AtomicUpdates(false), ElideBarriers(false), NativeTLS(false) {}
+    // If non-zero, THREADS is this compile-time constant
+    unsigned StaticThreads;
+    // Split relaxed gets into an initiation and a sync
+    bool NonBlockingGets;
+    // Leave relaxed puts outstanding until something could observe them
+    bool DeferredPuts;
+    // Apply relaxed integer updates whose value is unused at the owner
+    bool AtomicUpdates;
+    // Remove barriers that only separate private code from another barrier
+    bool ElideBarriers;
+    // Make thread-local globals __thread instead of runtime TLD
+    bool NativeTLS;
+  };
+
   /* Copied from DeclPrinter.cpp */
   static QualType GetBaseType(QualType T) {
     // FIXME: This should be on the Type class!
@@ -107,6 +128,7 @@ namespace {
     FunctionDecl * upcr_poll;
     FunctionDecl * upcr_mythread;
     FunctionDecl * upcr_threads;
+    FunctionDecl * UPCRT_CHECK_THREADS;
     FunctionDecl * upcr_hasMyAffinity_pshared;
     FunctionDecl * upcr_hasMyAffinity_shared;
     FunctionDecl * UPCR_BEGIN_FUNCTION;
@@ -146,6 +168,25 @@ namespace {
     UPCRCommFn UPCR_PUT_IVAL;
     UPCRCommFn UPCR_PUT_FVAL;
     UPCRCommFn UPCR_PUT_DVAL;
+    // Non-blocking gets only have relaxed versions
+    UPCRCommFn UPCR_GET_NB;
+    UPCRCommFn UPCR_GET_NB_VAL;
+    FunctionDecl * upcr_wait_syncnb;
+    FunctionDecl * upcr_wait_syncnb_valget;
+    // Implicit handle puts, also only relaxed
+    UPCRCommFn UPCR_PUT_NBI;
+    UPCRCommFn UPCR_PUT_NBI_VAL;
+    FunctionDecl * upcr_wait_syncnbi_puts;
+    // bupc_atomic{I32,U32,I64,U64}_fetch{add,and,or,xor}_relaxed
+    enum { ATOMIC_ADD, ATOMIC_AND, ATOMIC_OR, ATOMIC_XOR, ATOMIC_NUM_OPS };
+    FunctionDecl * bupc_atomic_fetch[4][ATOMIC_NUM_OPS];
+    // Implicit handle gets
+    FunctionDecl * upcrt_gather;
+    FunctionDecl * upcr_phaseof_shared;
+    FunctionDecl * upcr_memcpy;
+    FunctionDecl * upcr_memget;
+    FunctionDecl * upcr_memput;
+    FunctionDecl * upcr_memset;
     VarDecl * upcrt_forall_control;
     VarDecl * upcr_null_shared;
     VarDecl * upcr_null_pshared;
@@ -154,6 +195,8 @@ namespace {
     QualType upcr_startup_shalloc_t;
     QualType upcr_startup_pshalloc_t;
     QualType upcr_register_value_t;
+    QualType upcr_handle_t;
+    QualType upcr_valget_handle_t;
     SourceLocation FakeLocation;
     explicit UPCRDecls(ASTContext& Context) {
       SourceManager& SourceMgr = Context.getSourceManager();
@@ -170,6 +213,8 @@ namespace {
 
       // FIXME: This is a fair assumption, but should really get true type
       upcr_register_value_t = CreateTypedefType(Context, "upcr_register_value_t", Context.getUIntPtrType());
+      upcr_handle_t = CreateTypedefType(Context, "upcr_handle_t", Context.VoidPtrTy);
+      upcr_valget_handle_t = CreateTypedefType(Context, "upcr_valget_handle_t", Context.VoidPtrTy);
 
       // upcr_notify
       {
@@ -198,6 +243,11 @@ namespace {
       {
 	upcr_threads = CreateFunction(Context, "upcr_threads", Context.IntTy, 0, 0);
       }
+      // UPCRT_CHECK_THREADS
+      {
+	QualType argTypes[] = { Context.IntTy };
+	UPCRT_CHECK_THREADS = CreateFunction(Context, "UPCRT_CHECK_THREADS", Context.VoidTy, argTypes, 1);
+      }
       // upcr_hasMyAffinity_pshared
       {
 	QualType argTypes[] = { upcr_pshared_ptr_t };
@@ -422,6 +472,91 @@ namespace {
 	UPCR_PUT_DVAL[CFNK_SHARED] = CreateFunction(Context, "upcr_put_shared_doubleval", Context.VoidTy, argTypes, 3);
 	UPCR_PUT_DVAL[CFNK_SHARED_STRICT] = CreateFunction(Context, "upcr_put_shared_doubleval_strict", Context.VoidTy, argTypes, 3);
       }
+      // UPCR_GET_NB_{,P}SHARED
+      {
+	QualType pargTypes[] = { Context.VoidPtrTy, upcr_pshared_ptr_t, Context.IntTy, Context.IntTy };
+	UPCR_GET_NB[CFNK_PSHARED] = CreateFunction(Context, "upcr_get_nb_pshared", upcr_handle_t, pargTypes, 4);
+	QualType argTypes[] = { Context.VoidPtrTy, upcr_shared_ptr_t, Context.IntTy, Context.IntTy };
+	UPCR_GET_NB[CFNK_SHARED] = CreateFunction(Context, "upcr_get_nb_shared", upcr_handle_t, argTypes, 4);
+      }
+      // UPCR_GET_NB_{,P}SHARED_VAL
+      {
+	QualType pargTypes[] = { upcr_pshared_ptr_t, Context.IntTy, Context.IntTy };
+	UPCR_GET_NB_VAL[CFNK_PSHARED] = CreateFunction(Context, "upcr_get_nb_pshared_val", upcr_valget_handle_t, pargTypes, 3);
+	QualType argTypes[] = { upcr_shared_ptr_t, Context.IntTy, Context.IntTy };
+	UPCR_GET_NB_VAL[CFNK_SHARED] = CreateFunction(Context, "upcr_get_nb_shared_val", upcr_valget_handle_t, argTypes, 3);
+      }
+      // upcr_wait_syncnb
+      {
+	QualType argTypes[] = { upcr_handle_t };
+	upcr_wait_syncnb = CreateFunction(Context, "upcr_wait_syncnb", Context.VoidTy, argTypes, 1);
+      }
+      // upcr_wait_syncnb_valget
+      {
+	QualType argTypes[] = { upcr_valget_handle_t };
+	upcr_wait_syncnb_valget = CreateFunction(Context, "upcr_wait_syncnb_valget", upcr_register_value_t, argTypes, 1);
+      }
+      // UPCR_PUT_NBI_{,P}SHARED
+      {
+	QualType pargTypes[] = { upcr_pshared_ptr_t, Context.IntTy, Context.VoidPtrTy, Context.IntTy };
+	UPCR_PUT_NBI[CFNK_PSHARED] = CreateFunction(Context, "upcr_put_nbi_pshared", Context.VoidTy, pargTypes, 4);
+	QualType argTypes[] = { upcr_shared_ptr_t, Context.IntTy, Context.VoidPtrTy, Context.IntTy };
+	UPCR_PUT_NBI[CFNK_SHARED] = CreateFunction(Context, "upcr_put_nbi_shared", Context.VoidTy, argTypes, 4);
+      }
+      // UPCR_PUT_NBI_{,P}SHARED_VAL
+      {
+	QualType pargTypes[] = { upcr_pshared_ptr_t, Context.IntTy, upcr_register_value_t, Context.IntTy };
+	UPCR_PUT_NBI_VAL[CFNK_PSHARED] = CreateFunction(Context, "upcr_put_nbi_pshared_val", Context.VoidTy, pargTypes, 4);
+	QualType argTypes[] = { upcr_shared_ptr_t, Context.IntTy, upcr_register_value_t, Context.IntTy };
+	UPCR_PUT_NBI_VAL[CFNK_SHARED] = CreateFunction(Context, "upcr_put_nbi_shared_val", Context.VoidTy, argTypes, 4);
+      }
+      // upcr_wait_syncnbi_puts
+      {
+	upcr_wait_syncnbi_puts = CreateFunction(Context, "upcr_wait_syncnbi_puts", Context.VoidTy, 0, 0);
+      }
+      // bupc_atomic{I32,U32,I64,U64}_fetch{add,and,or,xor}_relaxed
+      {
+	const char * TypeNames[] = { "I32", "U32", "I64", "U64" };
+	const char * OpNames[] = { "add", "and", "or", "xor" };
+	for(int i = 0; i < 4; ++i) {
+	  QualType Ty = Context.getIntTypeForBitwidth(i < 2? 32 : 64, i % 2 == 0);
+	  QualType argTypes[] = { upcr_shared_ptr_t, Ty };
+	  for(int j = 0; j < ATOMIC_NUM_OPS; ++j) {
+	    std::string Name = std::string("bupc_atomic") + TypeNames[i] + "_fetch" + OpNames[j] + "_relaxed";
+	    bupc_atomic_fetch[i][j] = CreateFunction(Context, Name, Ty, argTypes, 2);
+	  }
+	}
+      }
+      // upcrt_gather
+      {
+	QualType argTypes[] = { Context.VoidPtrTy, Context.getPointerType(upcr_shared_ptr_t), Context.getSizeType(), Context.getSizeType() };
+	upcrt_gather = CreateFunction(Context, "upcrt_gather", Context.VoidTy, argTypes, 4);
+      }
+      // upcr_phaseof_shared
+      {
+	QualType argTypes[] = { upcr_shared_ptr_t };
+	upcr_phaseof_shared = CreateFunction(Context, "upcr_phaseof_shared", Context.getSizeType(), argTypes, 1);
+      }
+      // upcr_memcpy
+      {
+	QualType argTypes[] = { upcr_shared_ptr_t, upcr_shared_ptr_t, Context.getSizeType() };
+	upcr_memcpy = CreateFunction(Context, "upcr_memcpy", Context.VoidTy, argTypes, 3);
+      }
+      // upcr_memget
+      {
+	QualType argTypes[] = { Context.VoidPtrTy, upcr_shared_ptr_t, Context.getSizeType() };
+	upcr_memget = CreateFunction(Context, "upcr_memget", Context.VoidTy, argTypes, 3);
+      }
+      // upcr_memput
+      {
+	QualType argTypes[] = { upcr_shared_ptr_t, Context.getPointerType(Context.getConstType(Context.VoidTy)), Context.getSizeType() };
+	upcr_memput = CreateFunction(Context, "upcr_memput", Context.VoidTy, argTypes, 3);
+      }
+      // upcr_memset
+      {
+	QualType argTypes[] = { upcr_shared_ptr_t, Context.IntTy, Context.getSizeType() };
+	upcr_memset = CreateFunction(Context, "upcr_memset", Context.VoidTy, argTypes, 3);
+      }
       // upcrt_forall_control
       {
 	DeclContext *DC = Context.getTranslationUnitDecl();
@@ -521,6 +656,15 @@ namespace {
     bool Found;
   };
 
+  // Determines whether a function uses split-phase barriers,
+  // which may leave a upc_notify pending across other code.
+  class CheckForSplitBarrier : public clang::RecursiveASTVisitor<CheckForSplitBarrier> {
+  public:
+    CheckForSplitBarrier() : Found(false) {}
+    bool VisitUPCNotifyStmt(UPCNotifyStmt *) { Found = true; return false; }
+    bool Found;
+  };
+
   // Determines whether a typedef can safely be moved to
   // the global scope.  Variable arrays cannot be, since
   // they depend on local variables.
@@ -539,16 +683,1099 @@ namespace {
     bool Found;
   };
 
+  // Checks whether a statement contains any function calls.
+  class CheckForCall : public clang::RecursiveASTVisitor<CheckForCall> {
+  public:
+    CheckForCall() : Found(false) {}
+    bool VisitCallExpr(CallExpr *) {
+      Found = true;
+      return false;
+    }
+    bool Found;
+  };
+
+  // Collects the variables that a statement may assign to or
+  // take the address of.  Also notes constructs that make it
+  // unsafe to insert code in front of the statement.
+  class CheckForModifiedDecls : public clang::RecursiveASTVisitor<CheckForModifiedDecls> {
+    typedef RecursiveASTVisitor<CheckForModifiedDecls> Base;
+  public:
+    CheckForModifiedDecls() : HasCall(false), HasLabel(false), SwitchDepth(0) {}
+    bool TraverseSwitchStmt(SwitchStmt *S) {
+      ++SwitchDepth;
+      bool Result = Base::TraverseSwitchStmt(S);
+      --SwitchDepth;
+      return Result;
+    }
+    bool VisitBinaryOperator(BinaryOperator *E) {
+      if(E->isAssignmentOp())
+        AddModified(E->getLHS(), false);
+      return true;
+    }
+    bool VisitUnaryOperator(UnaryOperator *E) {
+      if(E->isIncrementDecrementOp())
+        AddModified(E->getSubExpr(), false);
+      else if(E->getOpcode() == UO_AddrOf)
+        AddModified(E->getSubExpr(), true);
+      return true;
+    }
+    bool VisitDeclStmt(DeclStmt *S) {
+      for(DeclStmt::decl_iterator iter = S->decl_begin(), end = S->decl_end(); iter != end; ++iter) {
+        Modified.insert(*iter);
+      }
+      return true;
+    }
+    bool VisitCallExpr(CallExpr *) {
+      HasCall = true;
+      return true;
+    }
+    bool VisitLabelStmt(LabelStmt *) {
+      HasLabel = true;
+      return true;
+    }
+    bool VisitSwitchCase(SwitchCase *) {
+      // A case label for a switch outside the statement
+      if(SwitchDepth == 0)
+        HasLabel = true;
+      return true;
+    }
+    void AddModified(Expr *E, bool AddrOf) {
+      E = E->IgnoreParenImpCasts();
+      for(;;) {
+        if(MemberExpr *ME = dyn_cast<MemberExpr>(E)) {
+          if(ME->isArrow()) return;
+          E = ME->getBase()->IgnoreParenImpCasts();
+        } else if(ArraySubscriptExpr *AE = dyn_cast<ArraySubscriptExpr>(E)) {
+          if(!AE->getBase()->IgnoreParenImpCasts()->getType()->isArrayType()) return;
+          E = AE->getBase()->IgnoreParenImpCasts();
+        } else {
+          break;
+        }
+      }
+      if(DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(E)) {
+        Modified.insert(DRE->getDecl());
+        if(AddrOf)
+          AddressTaken.insert(DRE->getDecl());
+      }
+    }
+    std::set<Decl*> Modified;
+    std::set<Decl*> AddressTaken;
+    bool HasCall;
+    bool HasLabel;
+  private:
+    int SwitchDepth;
+  };
+
+  // Collects the variables that an expression refers to, and notes
+  // whether any of them might change behind our back.
+  class CheckForUnstableRefs : public clang::RecursiveASTVisitor<CheckForUnstableRefs> {
+  public:
+    CheckForUnstableRefs(const std::set<Decl*>& AT) : Found(false), AddressTaken(AT) {}
+    bool VisitDeclRefExpr(DeclRefExpr *E) {
+      if(VarDecl *VD = dyn_cast<VarDecl>(E->getDecl())) {
+        Vars.insert(VD);
+        if(VD->getType().isVolatileQualified() || AddressTaken.count(VD))
+          Found = true;
+      }
+      return true;
+    }
+    std::set<Decl*> Vars;
+    bool Found;
+  private:
+    const std::set<Decl*>& AddressTaken;
+  };
+
+  // Checks whether an expression reads any shared data.
+  class CheckForSharedLoad : public clang::RecursiveASTVisitor<CheckForSharedLoad> {
+  public:
+    CheckForSharedLoad() : Found(false) {}
+    bool VisitImplicitCastExpr(ImplicitCastExpr *E) {
+      if(E->getCastKind() == CK_LValueToRValue && E->getSubExpr()->getType().getQualifiers().hasShared()) {
+        Found = true;
+        return false;
+      }
+      return true;
+    }
+    bool Found;
+  };
+
+  // Checks whether a statement may touch shared data, or any
+  // memory reached through a pointer.
+  class CheckForNonPrivateAccess : public clang::RecursiveASTVisitor<CheckForNonPrivateAccess> {
+  public:
+    CheckForNonPrivateAccess(ASTContext& C) : Found(false), Context(C) {}
+    bool VisitCallExpr(CallExpr *) { Found = true; return false; }
+    bool VisitStmtExpr(StmtExpr *) { Found = true; return false; }
+    bool VisitImplicitCastExpr(ImplicitCastExpr *E) {
+      if(E->getCastKind() == CK_LValueToRValue)
+        AddAccess(E->getSubExpr());
+      return !Found;
+    }
+    bool VisitBinaryOperator(BinaryOperator *E) {
+      if(E->isAssignmentOp())
+        AddAccess(E->getLHS());
+      return !Found;
+    }
+    bool VisitUnaryOperator(UnaryOperator *E) {
+      if(E->isIncrementDecrementOp())
+        AddAccess(E->getSubExpr());
+      return !Found;
+    }
+    bool Found;
+  private:
+    void AddAccess(Expr *E) {
+      QualType Ty = E->getType();
+      bool Literal;
+      if(Ty.getQualifiers().hasShared() || Ty.isVolatileQualified() ||
+         !GetAccessRoot(Context, E, Literal))
+        Found = true;
+    }
+    ASTContext& Context;
+  };
+
+  // Checks whether a function body uses the runtime itself: UPC
+  // statements and expressions, shared types and indirect calls.
+  // Direct callees and global variables are collected for the
+  // caller to check.
+  class CheckForRuntimeUse : public clang::RecursiveASTVisitor<CheckForRuntimeUse> {
+  public:
+    CheckForRuntimeUse() : Found(false) {}
+    bool VisitExpr(Expr *E) {
+      QualType Ty = E->getType();
+      if(const PointerType *PT = Ty->getAs<PointerType>())
+        Ty = PT->getPointeeType();
+      if(Ty.getQualifiers().hasShared())
+        Found = true;
+      return !Found;
+    }
+    bool VisitCallExpr(CallExpr *E) {
+      FunctionDecl *FD = E->getDirectCallee();
+      if(!FD)
+        Found = true;
+      else if(!FD->getBuiltinID())
+        Callees.insert(FD);
+      return !Found;
+    }
+    bool VisitDeclRefExpr(DeclRefExpr *E) {
+      if(VarDecl *VD = dyn_cast<VarDecl>(E->getDecl())) {
+        if(VD->hasGlobalStorage())
+          Globals.insert(VD);
+      }
+      return true;
+    }
+    bool VisitUPCThreadExpr(UPCThreadExpr *) { Found = true; return false; }
+    bool VisitUPCMyThreadExpr(UPCMyThreadExpr *) { Found = true; return false; }
+    bool VisitUPCNotifyStmt(UPCNotifyStmt *) { Found = true; return false; }
+    bool VisitUPCWaitStmt(UPCWaitStmt *) { Found = true; return false; }
+    bool VisitUPCBarrierStmt(UPCBarrierStmt *) { Found = true; return false; }
+    bool VisitUPCFenceStmt(UPCFenceStmt *) { Found = true; return false; }
+    bool VisitUPCForAllStmt(UPCForAllStmt *) { Found = true; return false; }
+    bool Found;
+    std::set<FunctionDecl*> Callees;
+    std::set<VarDecl*> Globals;
+  };
+
+  // Finds relaxed shared loads in a compound statement that read
+  // the same location as an earlier load in the same run of
+  // expression and declaration statements, with no store, call,
+  // strict access or synchronization in between.  The relaxed
+  // memory model allows such loads to reuse the earlier value.
+  class RedundantLoadFinder {
+  public:
+    struct LoadGroup {
+      LoadGroup(ImplicitCastExpr *F, unsigned I, unsigned E) : First(F), StmtIndex(I), IssueIndex(E) {}
+      // The first load, which must be evaluated unconditionally
+      ImplicitCastExpr *First;
+      // The index of the statement containing First
+      unsigned StmtIndex;
+      // The earliest statement in front of which the
+      // load could be started
+      unsigned IssueIndex;
+      // Later loads of the same location
+      std::vector<ImplicitCastExpr*> Uses;
+    };
+    RedundantLoadFinder(ASTContext& C, const std::set<Decl*>& AT)
+      : Context(C), AddressTaken(AT), CurStmt(0), Conditional(0), StmtKilledAll(false), LastKillAll(-1) {}
+    void ScanBody(CompoundStmt *S) {
+      for(CompoundStmt::body_iterator B = S->body_begin(), BEnd = S->body_end(); B != BEnd; ++B, ++CurStmt) {
+        StmtKilledAll = false;
+        StmtKilledVars.clear();
+        if(Expr *E = dyn_cast<Expr>(*B)) {
+          ScanExpr(E);
+        } else if(DeclStmt *DS = dyn_cast<DeclStmt>(*B)) {
+          for(DeclStmt::decl_iterator iter = DS->decl_begin(), end = DS->decl_end(); iter != end; ++iter) {
+            if(VarDecl *VD = dyn_cast<VarDecl>(*iter)) {
+              if(VD->getInit())
+                ScanExpr(VD->getInit());
+              KillVar(VD);
+            }
+          }
+        } else {
+          // Control flow, labels and synchronization end the run
+          KillAll();
+        }
+      }
+    }
+    std::vector<LoadGroup> Groups;
+  private:
+    struct LiveLoad {
+      llvm::FoldingSetNodeID Key;
+      std::set<Decl*> Vars;
+      std::size_t Group;
+    };
+    // Subexpressions are visited in an order consistent
+    // with the sequencing rules of C.
+    void ScanExpr(Expr *E) {
+      E = E->IgnoreParens();
+      if(ImplicitCastExpr *CE = dyn_cast<ImplicitCastExpr>(E)) {
+        if(CE->getCastKind() == CK_LValueToRValue && CE->getSubExpr()->getType().getQualifiers().hasShared()) {
+          ScanExpr(CE->getSubExpr());
+          AddLoad(CE);
+          return;
+        }
+      } else if(BinaryOperator *BO = dyn_cast<BinaryOperator>(E)) {
+        ScanExpr(BO->getLHS());
+        if(BO->getOpcode() == BO_LAnd || BO->getOpcode() == BO_LOr) ++Conditional;
+        ScanExpr(BO->getRHS());
+        if(BO->getOpcode() == BO_LAnd || BO->getOpcode() == BO_LOr) --Conditional;
+        if(BO->isAssignmentOp())
+          Modify(BO->getLHS());
+        return;
+      } else if(UnaryOperator *UO = dyn_cast<UnaryOperator>(E)) {
+        ScanExpr(UO->getSubExpr());
+        if(UO->isIncrementDecrementOp())
+          Modify(UO->getSubExpr());
+        return;
+      } else if(ConditionalOperator *CO = dyn_cast<ConditionalOperator>(E)) {
+        ScanExpr(CO->getCond());
+        ++Conditional;
+        ScanExpr(CO->getLHS());
+        ScanExpr(CO->getRHS());
+        --Conditional;
+        return;
+      } else if(isa<UnaryExprOrTypeTraitExpr>(E)) {
+        // Not evaluated
+        return;
+      } else if(isa<StmtExpr>(E) || isa<BinaryConditionalOperator>(E)) {
+        KillAll();
+        return;
+      }
+      for(Stmt *Child : E->children()) {
+        if(Expr *ChildExpr = dyn_cast_or_null<Expr>(Child))
+          ScanExpr(ChildExpr);
+      }
+      if(isa<CallExpr>(E))
+        KillAll();
+    }
+    void AddLoad(ImplicitCastExpr *CE) {
+      Expr *Addr = CE->getSubExpr();
+      QualType Ty = Addr->getType();
+      if(Ty.getQualifiers().hasStrict() || Ty.isVolatileQualified()) {
+        KillAll();
+        return;
+      }
+      if(Addr->HasSideEffects(Context))
+        return;
+      CheckForUnstableRefs Refs(AddressTaken);
+      Refs.TraverseStmt(Addr);
+      if(Refs.Found)
+        return;
+      llvm::FoldingSetNodeID Key;
+      Addr->Profile(Key, Context, true);
+      for(std::size_t i = 0; i < Live.size(); ++i) {
+        if(Live[i].Key == Key) {
+          Groups[Live[i].Group].Uses.push_back(CE);
+          return;
+        }
+      }
+      // The value can only be loaded in front of the statement if
+      // nothing earlier in the statement could have changed it.
+      if(Conditional > 0 || StmtKilledAll)
+        return;
+      int LastKill = LastKillAll;
+      for(std::set<Decl*>::iterator iter = Refs.Vars.begin(), end = Refs.Vars.end(); iter != end; ++iter) {
+        if(StmtKilledVars.count(*iter))
+          return;
+        std::map<Decl*, int>::iterator pos = LastKillVar.find(*iter);
+        if(pos != LastKillVar.end())
+          LastKill = std::max(LastKill, pos->second);
+      }
+      Live.push_back(LiveLoad());
+      Live.back().Key = Key;
+      Live.back().Vars.swap(Refs.Vars);
+      Live.back().Group = Groups.size();
+      Groups.push_back(LoadGroup(CE, CurStmt, LastKill + 1));
+    }
+    void Modify(Expr *E) {
+      if(E->getType().getQualifiers().hasShared()) {
+        KillAll();
+        return;
+      }
+      E = E->IgnoreParenImpCasts();
+      for(;;) {
+        if(MemberExpr *ME = dyn_cast<MemberExpr>(E)) {
+          if(ME->isArrow()) break;
+          E = ME->getBase()->IgnoreParenImpCasts();
+        } else if(ArraySubscriptExpr *AE = dyn_cast<ArraySubscriptExpr>(E)) {
+          if(!AE->getBase()->IgnoreParenImpCasts()->getType()->isArrayType()) break;
+          E = AE->getBase()->IgnoreParenImpCasts();
+        } else {
+          break;
+        }
+      }
+      if(DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(E)) {
+        KillVar(DRE->getDecl());
+      } else {
+        // A private pointer may point into shared memory
+        KillAll();
+      }
+    }
+    void KillVar(Decl *D) {
+      StmtKilledVars.insert(D);
+      LastKillVar[D] = CurStmt;
+      for(std::size_t i = 0; i < Live.size(); ) {
+        if(Live[i].Vars.count(D)) {
+          Live.erase(Live.begin() + i);
+        } else {
+          ++i;
+        }
+      }
+    }
+    void KillAll() {
+      StmtKilledAll = true;
+      LastKillAll = CurStmt;
+      Live.clear();
+    }
+    ASTContext& Context;
+    const std::set<Decl*>& AddressTaken;
+    std::vector<LiveLoad> Live;
+    unsigned CurStmt;
+    int Conditional;
+    bool StmtKilledAll;
+    std::set<Decl*> StmtKilledVars;
+    // The last statements that changed anything, or each variable
+    int LastKillAll;
+    std::map<Decl*, int> LastKillVar;
+  };
+
+  // Returns the variable that an lvalue is a part of, if it is
+  // only reached through members and array elements.  Literal
+  // is cleared if any array index is not an in range constant.
+  VarDecl *GetAccessRoot(ASTContext& Context, Expr *E, bool& Literal) {
+    Literal = true;
+    E = E->IgnoreParenImpCasts();
+    for(;;) {
+      if(MemberExpr *ME = dyn_cast<MemberExpr>(E)) {
+        if(ME->isArrow()) return 0;
+        E = ME->getBase()->IgnoreParenImpCasts();
+      } else if(ArraySubscriptExpr *AE = dyn_cast<ArraySubscriptExpr>(E)) {
+        Expr *Base = AE->getBase()->IgnoreParenImpCasts();
+        const ArrayType *AT = Context.getAsArrayType(Base->getType());
+        if(!AT) return 0;
+        IntegerLiteral *Idx = dyn_cast<IntegerLiteral>(AE->getIdx()->IgnoreParenImpCasts());
+        llvm::APInt Size;
+        if(const ConstantArrayType *CAT = dyn_cast<ConstantArrayType>(AT)) {
+          Size = CAT->getSize();
+        } else if(const UPCThreadArrayType *TAT = dyn_cast<UPCThreadArrayType>(AT)) {
+          Size = TAT->getSize();
+        }
+        if(!Idx || !Size || Idx->getValue().getLimitedValue() >= Size.getLimitedValue())
+          Literal = false;
+        E = Base;
+      } else {
+        break;
+      }
+    }
+    if(DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(E))
+      return dyn_cast<VarDecl>(DRE->getDecl());
+    return 0;
+  }
+
+  // Summarizes the memory accesses of a statement, for deciding
+  // where outstanding non-blocking puts must be completed.
+  // Accesses through pointers, shared or private, may touch
+  // any shared object.
+  class SharedAccessSummary : public clang::RecursiveASTVisitor<SharedAccessSummary> {
+  public:
+    SharedAccessSummary(ASTContext& C)
+      : HasCall(false), HasStrict(false), HasStmtExpr(false), HasSequencing(false),
+        HasMemoryLoad(false), Stores(0), Context(C) {}
+    bool VisitCallExpr(CallExpr *) { HasCall = true; return true; }
+    bool VisitStmtExpr(StmtExpr *) { HasStmtExpr = true; return true; }
+    bool VisitAbstractConditionalOperator(AbstractConditionalOperator *) { HasSequencing = true; return true; }
+    bool VisitImplicitCastExpr(ImplicitCastExpr *E) {
+      if(E->getCastKind() == CK_LValueToRValue)
+        AddAccess(E->getSubExpr(), true, false);
+      return true;
+    }
+    bool VisitBinaryOperator(BinaryOperator *E) {
+      if(E->isAssignmentOp())
+        AddAccess(E->getLHS(), E->isCompoundAssignmentOp(), true);
+      else if(E->getOpcode() == BO_Comma || E->getOpcode() == BO_LAnd || E->getOpcode() == BO_LOr)
+        HasSequencing = true;
+      return true;
+    }
+    bool VisitUnaryOperator(UnaryOperator *E) {
+      if(E->isIncrementDecrementOp())
+        AddAccess(E->getSubExpr(), true, true);
+      return true;
+    }
+    // Whether the statement may access memory written by puts to
+    // the variables in Roots, or through a pointer if AnyPointer.
+    bool MayAccess(const std::set<VarDecl*>& Roots, bool AnyPointer, bool LoadsOnly) const {
+      for(std::size_t i = 0; i < Accesses.size(); ++i) {
+        if(LoadsOnly && !Accesses[i].Load)
+          continue;
+        if(!Accesses[i].Root) {
+          if(AnyPointer || !Roots.empty())
+            return true;
+        } else if(AnyPointer || Roots.count(Accesses[i].Root)) {
+          return true;
+        }
+      }
+      return false;
+    }
+    bool MustSyncBefore(const std::set<VarDecl*>& Roots, bool AnyPointer) const {
+      return HasCall || HasStrict || HasStmtExpr || MayAccess(Roots, AnyPointer, false);
+    }
+    // The puts of a statement can be left outstanding unless
+    // something later in the same statement might observe them.
+    bool CanDefer() const {
+      return !HasCall && !HasStrict && !HasStmtExpr &&
+        (!HasSequencing || (Stores <= 1 && !HasMemoryLoad));
+    }
+    // Whether anything, shared or private, is stored through a pointer
+    bool HasPointerStore() const {
+      for(std::size_t i = 0; i < Accesses.size(); ++i) {
+        if(Accesses[i].Store && !Accesses[i].Root)
+          return true;
+      }
+      return false;
+    }
+    void AddStores(std::set<VarDecl*>& Roots, bool& AnyPointer) const {
+      for(std::size_t i = 0; i < Accesses.size(); ++i) {
+        if(!Accesses[i].Store || !Accesses[i].Shared)
+          continue;
+        if(Accesses[i].Root)
+          Roots.insert(Accesses[i].Root);
+        else
+          AnyPointer = true;
+      }
+    }
+    bool HasCall;
+    bool HasStrict;
+    bool HasStmtExpr;
+    bool HasSequencing;
+    bool HasMemoryLoad;
+    int Stores;
+  private:
+    struct Access {
+      VarDecl *Root;  // NULL if through a pointer
+      bool Shared;
+      bool Load;
+      bool Store;
+    };
+    void AddAccess(Expr *E, bool Load, bool Store) {
+      QualType Ty = E->getType();
+      bool Shared = Ty.getQualifiers().hasShared();
+      if(Shared && (Ty.getQualifiers().hasStrict() || Ty.isVolatileQualified()))
+        HasStrict = true;
+      bool Literal;
+      Access A;
+      A.Root = GetAccessRoot(Context, E, Literal);
+      // Private variables are never written by puts
+      if(A.Root && !Shared)
+        return;
+      A.Shared = Shared;
+      A.Load = Load;
+      A.Store = Store;
+      Accesses.push_back(A);
+      if(Load)
+        HasMemoryLoad = true;
+      if(Store && Shared)
+        ++Stores;
+    }
+    ASTContext& Context;
+    std::vector<Access> Accesses;
+  };
+
+  // Finds relaxed shared scalars that a loop only accesses by name,
+  // so that their value can be kept in a private temporary while
+  // the loop runs.  Any call, synchronization, strict access or exit
+  // from the loop other than break prevents this.
+  class FindPromotableShared : public clang::RecursiveASTVisitor<FindPromotableShared> {
+  public:
+    struct Candidate {
+      Candidate() : Read(false), Written(false) {}
+      // Every occurrence of the variable in the loop
+      std::vector<Expr*> LValues;
+      bool Read;
+      bool Written;
+    };
+    FindPromotableShared(ASTContext& C) : Context(C), Unsafe(false) {}
+    bool VisitCallExpr(CallExpr *) { Unsafe = true; return true; }
+    bool VisitReturnStmt(ReturnStmt *) { Unsafe = true; return true; }
+    bool VisitGotoStmt(GotoStmt *) { Unsafe = true; return true; }
+    bool VisitIndirectGotoStmt(IndirectGotoStmt *) { Unsafe = true; return true; }
+    bool VisitAsmStmt(AsmStmt *) { Unsafe = true; return true; }
+    bool VisitUPCNotifyStmt(UPCNotifyStmt *) { Unsafe = true; return true; }
+    bool VisitUPCWaitStmt(UPCWaitStmt *) { Unsafe = true; return true; }
+    bool VisitUPCBarrierStmt(UPCBarrierStmt *) { Unsafe = true; return true; }
+    bool VisitUPCFenceStmt(UPCFenceStmt *) { Unsafe = true; return true; }
+    bool VisitImplicitCastExpr(ImplicitCastExpr *E) {
+      if(E->getCastKind() == CK_LValueToRValue)
+        AddAccess(E->getSubExpr(), true, false);
+      return true;
+    }
+    bool VisitBinaryOperator(BinaryOperator *E) {
+      if(E->isAssignmentOp())
+        AddAccess(E->getLHS(), E->isCompoundAssignmentOp(), true);
+      return true;
+    }
+    bool VisitUnaryOperator(UnaryOperator *E) {
+      if(E->isIncrementDecrementOp()) {
+        AddAccess(E->getSubExpr(), true, true);
+      } else if(E->getOpcode() == UO_AddrOf) {
+        bool Literal;
+        if(VarDecl *Root = GetAccessRoot(Context, E->getSubExpr(), Literal))
+          Escaped.insert(Root);
+      }
+      return true;
+    }
+    void GetCandidates(std::vector<Candidate>& Result) {
+      if(Unsafe)
+        return;
+      std::set<VarDecl*> Rejected(Escaped);
+      for(std::size_t i = 0; i < Accesses.size(); ++i) {
+        Access& A = Accesses[i];
+        QualType Ty = A.LValue->getType();
+        bool Ok = A.Literal && Ty->isScalarType() && !Ty.isVolatileQualified();
+        if(const PointerType *PT = Ty->getAs<PointerType>())
+          Ok = Ok && !PT->getPointeeType().getQualifiers().hasShared();
+        for(std::size_t j = 0; Ok && j < Accesses.size(); ++j) {
+          if(Accesses[j].Root == A.Root && !(Accesses[j].Key == A.Key))
+            Ok = false;
+        }
+        for(std::size_t j = 0; Ok && j < PointerAccesses.size(); ++j) {
+          if(MayAlias(Context, Ty, PointerAccesses[j]))
+            Ok = false;
+        }
+        if(!Ok)
+          Rejected.insert(A.Root);
+      }
+      std::map<VarDecl*, std::size_t> Index;
+      for(std::size_t i = 0; i < Accesses.size(); ++i) {
+        Access& A = Accesses[i];
+        if(Rejected.count(A.Root))
+          continue;
+        std::map<VarDecl*, std::size_t>::iterator pos = Index.find(A.Root);
+        if(pos == Index.end()) {
+          pos = Index.insert(std::make_pair(A.Root, Result.size())).first;
+          Result.push_back(Candidate());
+        }
+        Candidate& C = Result[pos->second];
+        C.LValues.push_back(A.LValue);
+        C.Read = C.Read || A.Read;
+        C.Written = C.Written || A.Written;
+      }
+    }
+    // Whether accesses of these types through different lvalues
+    // may refer to the same object.
+    static bool MayAlias(ASTContext& Context, QualType A, QualType B) {
+      A = Context.getCanonicalType(A).getUnqualifiedType();
+      B = Context.getCanonicalType(B).getUnqualifiedType();
+      if(!A->isArithmeticType() || !B->isArithmeticType() ||
+         A->isCharType() || B->isCharType())
+        return true;
+      if(A->isIntegerType() && B->isIntegerType())
+        return Context.getTypeSize(A) == Context.getTypeSize(B);
+      return A == B;
+    }
+  private:
+    struct Access {
+      Expr *LValue;
+      VarDecl *Root;
+      llvm::FoldingSetNodeID Key;
+      bool Literal;
+      bool Read;
+      bool Written;
+    };
+    void AddAccess(Expr *E, bool Read, bool Written) {
+      QualType Ty = E->getType();
+      if(Ty.getQualifiers().hasStrict())
+        Unsafe = true;
+      bool Literal;
+      VarDecl *Root = GetAccessRoot(Context, E, Literal);
+      if(!Root) {
+        // Through a pointer, either shared or private
+        PointerAccesses.push_back(Ty);
+      } else if(Ty.getQualifiers().hasShared()) {
+        Accesses.push_back(Access());
+        Access& A = Accesses.back();
+        A.LValue = E->IgnoreParens();
+        A.Root = Root;
+        A.LValue->Profile(A.Key, Context, true);
+        A.Literal = Literal;
+        A.Read = Read;
+        A.Written = Written;
+      }
+    }
+    ASTContext& Context;
+    bool Unsafe;
+    std::vector<Access> Accesses;
+    std::vector<QualType> PointerAccesses;
+    std::set<VarDecl*> Escaped;
+  };
+
+  // Finds statements of a loop body that fold a value into an
+  // arithmetic lvalue: x op= e, x = x op e, x++ and if(e < x) x = e.
+  // A shared scalar whose every occurrence is in such updates of
+  // the same kind is a reduction.
+  class FindReductionUpdates : public clang::RecursiveASTVisitor<FindReductionUpdates> {
+  public:
+    enum Kind { RK_None, RK_Add, RK_Mul, RK_And, RK_Or, RK_Xor, RK_Min, RK_Max };
+    FindReductionUpdates(ASTContext& C) : Context(C) {}
+    bool VisitCompoundStmt(CompoundStmt *S) {
+      for(CompoundStmt::body_iterator iter = S->body_begin(), end = S->body_end(); iter != end; ++iter)
+        AddUpdate(*iter);
+      return true;
+    }
+    bool VisitIfStmt(IfStmt *S) {
+      AddUpdate(S->getThen());
+      if(S->getElse()) AddUpdate(S->getElse());
+      return true;
+    }
+    bool VisitForStmt(ForStmt *S) { AddUpdate(S->getBody()); return true; }
+    bool VisitWhileStmt(WhileStmt *S) { AddUpdate(S->getBody()); return true; }
+    bool VisitDoStmt(DoStmt *S) { AddUpdate(S->getBody()); return true; }
+    bool VisitUPCForAllStmt(UPCForAllStmt *S) { AddUpdate(S->getBody()); return true; }
+    void AddUpdate(Stmt *S) {
+      if(!S) return;
+      if(IfStmt *If = dyn_cast<IfStmt>(S)) {
+        AddMinMax(If);
+        return;
+      }
+      Expr *E = dyn_cast<Expr>(S);
+      if(!E) return;
+      E = E->IgnoreParens();
+      if(CompoundAssignOperator *CA = dyn_cast<CompoundAssignOperator>(E)) {
+        Add(CA->getLHS(), GetKind(BinaryOperator::getOpForCompoundAssignment(CA->getOpcode())));
+      } else if(UnaryOperator *UO = dyn_cast<UnaryOperator>(E)) {
+        if(UO->isIncrementDecrementOp())
+          Add(UO->getSubExpr(), RK_Add);
+      } else if(BinaryOperator *BO = dyn_cast<BinaryOperator>(E)) {
+        BinaryOperator *Op = dyn_cast<BinaryOperator>(BO->getRHS()->IgnoreParenImpCasts());
+        if(BO->getOpcode() != BO_Assign || !Op || GetKind(Op->getOpcode()) == RK_None)
+          return;
+        Expr *Read = GetLoadedLValue(Op->getLHS());
+        if((!Read || !isSame(Read, BO->getLHS())) && Op->getOpcode() != BO_Sub)
+          Read = GetLoadedLValue(Op->getRHS());
+        if(Read && isSame(Read, BO->getLHS())) {
+          Add(BO->getLHS(), GetKind(Op->getOpcode()));
+          Add(Read, GetKind(Op->getOpcode()));
+        }
+      }
+    }
+    // The common kind of the updates containing the lvalues, or
+    // RK_None if any of them is not part of an update.
+    Kind GetKind(const std::vector<Expr*>& LValues) {
+      Kind Result = RK_None;
+      for(std::size_t i = 0; i < LValues.size(); ++i) {
+        std::map<Expr*, Kind>::iterator pos = Updates.find(LValues[i]->IgnoreParens());
+        if(pos == Updates.end() || (i > 0 && pos->second != Result))
+          return RK_None;
+        Result = pos->second;
+      }
+      return Result;
+    }
+  private:
+    static Kind GetKind(BinaryOperatorKind Opc) {
+      switch(Opc) {
+      case BO_Add: case BO_Sub: return RK_Add;
+      case BO_Mul: return RK_Mul;
+      case BO_And: return RK_And;
+      case BO_Or: return RK_Or;
+      case BO_Xor: return RK_Xor;
+      default: return RK_None;
+      }
+    }
+    // if(e < x) x = e; and the other comparisons
+    void AddMinMax(IfStmt *S) {
+      if(S->getElse() || S->getConditionVariable())
+        return;
+      Stmt *Then = S->getThen();
+      if(CompoundStmt *CS = dyn_cast<CompoundStmt>(Then)) {
+        if(CS->size() != 1) return;
+        Then = CS->body_front();
+      }
+      BinaryOperator *Assign = dyn_cast<BinaryOperator>(Then);
+      BinaryOperator *Cond = dyn_cast<BinaryOperator>(S->getCond()->IgnoreParenImpCasts());
+      if(!Assign || Assign->getOpcode() != BO_Assign || !Cond || !Cond->isRelationalOp())
+        return;
+      Expr *X = Assign->getLHS();
+      Expr *Value = Assign->getRHS()->IgnoreParenImpCasts();
+      bool Less = Cond->getOpcode() == BO_LT || Cond->getOpcode() == BO_LE;
+      Expr *Read = GetLoadedLValue(Cond->getRHS());
+      if(Read && isSame(Read, X) && isSame(Cond->getLHS()->IgnoreParenImpCasts(), Value)) {
+        // e < x
+      } else if((Read = GetLoadedLValue(Cond->getLHS())) && isSame(Read, X) &&
+                isSame(Cond->getRHS()->IgnoreParenImpCasts(), Value)) {
+        // x > e
+        Less = !Less;
+      } else {
+        return;
+      }
+      Add(X, Less? RK_Min : RK_Max);
+      Add(Read, Less? RK_Min : RK_Max);
+    }
+    void Add(Expr *LValue, Kind K) {
+      if(K != RK_None && LValue->getType()->isArithmeticType())
+        Updates[LValue->IgnoreParens()] = K;
+    }
+    // The lvalue that E reads, looking through conversions
+    static Expr *GetLoadedLValue(Expr *E) {
+      E = E->IgnoreParens();
+      while(ImplicitCastExpr *CE = dyn_cast<ImplicitCastExpr>(E)) {
+        if(CE->getCastKind() == CK_LValueToRValue)
+          return CE->getSubExpr()->IgnoreParens();
+        E = CE->getSubExpr()->IgnoreParens();
+      }
+      return 0;
+    }
+    bool isSame(Expr *A, Expr *B) {
+      llvm::FoldingSetNodeID AID, BID;
+      A->IgnoreParens()->Profile(AID, Context, true);
+      B->IgnoreParens()->Profile(BID, Context, true);
+      return AID == BID;
+    }
+    ASTContext& Context;
+    std::map<Expr*, Kind> Updates;
+  };
+
+  // Finds reads of a[i + c] for small constant c in the body of a
+  // upc_forall with affinity &a[i].  The body must not synchronize
+  // or jump, since the neighbors are fetched once per block.
+  class FindHaloReads : public clang::RecursiveASTVisitor<FindHaloReads> {
+  public:
+    FindHaloReads(VarDecl *I, VarDecl *A, int64_t M) : IV(I), Array(A), MaxOffset(M), Unsafe(false) {}
+    bool VisitCallExpr(CallExpr *) { Unsafe = true; return true; }
+    bool VisitGotoStmt(GotoStmt *) { Unsafe = true; return true; }
+    bool VisitIndirectGotoStmt(IndirectGotoStmt *) { Unsafe = true; return true; }
+    bool VisitLabelStmt(LabelStmt *) { Unsafe = true; return true; }
+    bool VisitAsmStmt(AsmStmt *) { Unsafe = true; return true; }
+    bool VisitUPCNotifyStmt(UPCNotifyStmt *) { Unsafe = true; return true; }
+    bool VisitUPCWaitStmt(UPCWaitStmt *) { Unsafe = true; return true; }
+    bool VisitUPCBarrierStmt(UPCBarrierStmt *) { Unsafe = true; return true; }
+    bool VisitUPCFenceStmt(UPCFenceStmt *) { Unsafe = true; return true; }
+    bool VisitImplicitCastExpr(ImplicitCastExpr *E) {
+      if(E->getCastKind() != CK_LValueToRValue)
+        return true;
+      ArraySubscriptExpr *AE = dyn_cast<ArraySubscriptExpr>(E->getSubExpr()->IgnoreParens());
+      if(!AE || !isVariable(AE->getBase(), Array))
+        return true;
+      Expr *Idx = AE->getIdx()->IgnoreParenImpCasts();
+      int64_t Offset = 0;
+      if(BinaryOperator *BO = dyn_cast<BinaryOperator>(Idx)) {
+        IntegerLiteral *L = dyn_cast<IntegerLiteral>(BO->getLHS()->IgnoreParenImpCasts());
+        IntegerLiteral *R = dyn_cast<IntegerLiteral>(BO->getRHS()->IgnoreParenImpCasts());
+        if(BO->getOpcode() == BO_Add && R && isVariable(BO->getLHS(), IV)) {
+          Offset = R->getValue().getSExtValue();
+        } else if(BO->getOpcode() == BO_Add && L && isVariable(BO->getRHS(), IV)) {
+          Offset = L->getValue().getSExtValue();
+        } else if(BO->getOpcode() == BO_Sub && R && isVariable(BO->getLHS(), IV)) {
+          Offset = -R->getValue().getSExtValue();
+        } else {
+          return true;
+        }
+      } else if(!isVariable(Idx, IV)) {
+        return true;
+      }
+      if(Offset >= -MaxOffset && Offset <= MaxOffset)
+        Reads.push_back(std::make_pair(E, Offset));
+      return true;
+    }
+    static bool isVariable(Expr *E, VarDecl *VD) {
+      DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts());
+      return DRE && DRE->getDecl() == VD;
+    }
+    VarDecl *IV;
+    VarDecl *Array;
+    int64_t MaxOffset;
+    bool Unsafe;
+    std::vector<std::pair<ImplicitCastExpr*, int64_t> > Reads;
+  };
+
+  // Finds reads of shared array elements whose index is loaded from
+  // memory that depends on the loop variable, such as x[idx[i]], and
+  // that are evaluated on every iteration of a loop body.  The body
+  // must run to the end of the iteration, since these reads are
+  // issued for a whole strip of iterations up front.
+  class FindGatherReads {
+  public:
+    FindGatherReads(ASTContext& C, VarDecl *I) : Context(C), IV(I), Unsafe(false), SwitchDepth(0) {}
+    void Scan(Stmt *S, bool Conditional, bool InLoop) {
+      if(!S)
+        return;
+      if(isa<CallExpr>(S) || isa<StmtExpr>(S) || isa<BinaryConditionalOperator>(S) ||
+         isa<ReturnStmt>(S) || isa<GotoStmt>(S) || isa<IndirectGotoStmt>(S) ||
+         isa<LabelStmt>(S) || isa<AsmStmt>(S) || isa<UPCNotifyStmt>(S) ||
+         isa<UPCWaitStmt>(S) || isa<UPCBarrierStmt>(S) || isa<UPCFenceStmt>(S) ||
+         (isa<BreakStmt>(S) && !InLoop && !SwitchDepth) ||
+         (isa<ContinueStmt>(S) && !InLoop)) {
+        Unsafe = true;
+        return;
+      }
+      if(ImplicitCastExpr *E = dyn_cast<ImplicitCastExpr>(S)) {
+        if(!Conditional && isGather(E)) {
+          Reads.push_back(E);
+          return;
+        }
+      } else if(BinaryOperator *BO = dyn_cast<BinaryOperator>(S)) {
+        if(BO->isAssignmentOp())
+          AddStore(BO->getLHS());
+        if(BO->getOpcode() == BO_LAnd || BO->getOpcode() == BO_LOr) {
+          Scan(BO->getLHS(), Conditional, InLoop);
+          Scan(BO->getRHS(), true, InLoop);
+          return;
+        }
+      } else if(UnaryOperator *UO = dyn_cast<UnaryOperator>(S)) {
+        if(UO->isIncrementDecrementOp())
+          AddStore(UO->getSubExpr());
+      } else if(ConditionalOperator *CO = dyn_cast<ConditionalOperator>(S)) {
+        Scan(CO->getCond(), Conditional, InLoop);
+        Scan(CO->getTrueExpr(), true, InLoop);
+        Scan(CO->getFalseExpr(), true, InLoop);
+        return;
+      } else if(IfStmt *If = dyn_cast<IfStmt>(S)) {
+        Scan(If->getCond(), Conditional, InLoop);
+        Scan(If->getThen(), true, InLoop);
+        Scan(If->getElse(), true, InLoop);
+        return;
+      } else if(isa<ForStmt>(S) || isa<WhileStmt>(S) || isa<DoStmt>(S) ||
+                isa<UPCForAllStmt>(S)) {
+        for(Stmt::child_iterator iter = S->child_begin(), end = S->child_end(); iter != end; ++iter)
+          Scan(*iter, true, true);
+        return;
+      } else if(isa<SwitchStmt>(S)) {
+        // A continue inside a switch still leaves the iteration
+        ++SwitchDepth;
+        for(Stmt::child_iterator iter = S->child_begin(), end = S->child_end(); iter != end; ++iter)
+          Scan(*iter, true, InLoop);
+        --SwitchDepth;
+        return;
+      }
+      for(Stmt::child_iterator iter = S->child_begin(), end = S->child_end(); iter != end; ++iter)
+        Scan(*iter, Conditional, InLoop);
+    }
+    // The index must load from memory and use the loop variable
+    bool isGather(ImplicitCastExpr *E) {
+      if(E->getCastKind() != CK_LValueToRValue)
+        return false;
+      ArraySubscriptExpr *AE = dyn_cast<ArraySubscriptExpr>(E->getSubExpr()->IgnoreParens());
+      if(!AE || !AE->getBase()->getType()->getAs<PointerType>())
+        return false;
+      QualType Ty = AE->getType();
+      if(!Ty.getQualifiers().hasShared() || Ty.getQualifiers().hasStrict() ||
+         Ty.isVolatileQualified() || !Ty->isScalarType() || Ty->isPointerType() ||
+         AE->HasSideEffects(Context))
+        return false;
+      CheckForSharedLoad Loads;
+      Loads.TraverseStmt(AE->getBase());
+      Loads.TraverseStmt(AE->getIdx());
+      if(Loads.Found)
+        return false;
+      bool UsesIV = false, LoadsMemory = false;
+      FindIndexUses(AE->getIdx(), UsesIV, LoadsMemory);
+      return UsesIV && LoadsMemory;
+    }
+    void FindIndexUses(Stmt *S, bool& UsesIV, bool& LoadsMemory) {
+      if(DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(S)) {
+        if(DRE->getDecl() == IV)
+          UsesIV = true;
+      } else if(ImplicitCastExpr *E = dyn_cast<ImplicitCastExpr>(S)) {
+        Expr *Sub = E->getSubExpr()->IgnoreParens();
+        if(E->getCastKind() == CK_LValueToRValue && !isa<DeclRefExpr>(Sub)) {
+          LoadsMemory = true;
+          bool Literal;
+          if(!GetAccessRoot(Context, Sub, Literal))
+            PointerLoads.push_back(Sub->getType());
+        }
+      }
+      for(Stmt::child_iterator iter = S->child_begin(), end = S->child_end(); iter != end; ++iter)
+        if(*iter) FindIndexUses(*iter, UsesIV, LoadsMemory);
+    }
+    // Private stores through pointers, which may change the indices
+    void AddStore(Expr *E) {
+      bool Literal;
+      if(!E->getType().getQualifiers().hasShared() && !GetAccessRoot(Context, E, Literal))
+        IndirectStores.push_back(E->getType());
+    }
+    bool MayChangeIndices() const {
+      for(std::size_t i = 0; i < IndirectStores.size(); ++i)
+        for(std::size_t j = 0; j < PointerLoads.size(); ++j)
+          if(FindPromotableShared::MayAlias(Context, IndirectStores[i], PointerLoads[j]))
+            return true;
+      return false;
+    }
+    ASTContext& Context;
+    VarDecl *IV;
+    bool Unsafe;
+    int SwitchDepth;
+    std::vector<ImplicitCastExpr*> Reads;
+    std::vector<QualType> IndirectStores;
+    std::vector<QualType> PointerLoads;
+  };
+
+  // Builds the call graph of the translation unit and records
+  // which call sites are inside the body of a upc_forall with an
+  // affinity expression.  This lets us decide statically whether
+  // upcrt_forall_control is set when a function is entered.
+  class UPCCallGraph : public clang::RecursiveASTVisitor<UPCCallGraph> {
+    typedef RecursiveASTVisitor<UPCCallGraph> Base;
+  public:
+    typedef enum {
+      FAC_Undetermined = 0, // No call sites seen (yet)
+      FAC_Outside,          // Never called from inside a upc_forall
+      FAC_Inside,           // Always called from inside a upc_forall
+      FAC_Unknown           // Must be checked at run time
+    } ForAllContext;
+    struct CallSite {
+      CallSite(FunctionDecl *C, bool I, bool H) : Caller(C), InsideForAll(I), InForAllHeader(H) {}
+      FunctionDecl *Caller;
+      bool InsideForAll;
+      // In the header of a upc_forall, which runs with
+      // upcrt_forall_control already set
+      bool InForAllHeader;
+    };
+    struct FunctionInfo {
+      FunctionInfo() : AddressTaken(false), Context(FAC_Undetermined) {}
+      std::vector<CallSite> CallSites;
+      bool AddressTaken;
+      ForAllContext Context;
+    };
+    UPCCallGraph() : CurFunction(NULL), ForAllDepth(0), ForAllHeaderDepth(0) {}
+    bool TraverseFunctionDecl(FunctionDecl *FD) {
+      FunctionDecl *SavedFunction = CurFunction;
+      CurFunction = FD->getCanonicalDecl();
+      Functions[CurFunction];
+      bool Result = Base::TraverseFunctionDecl(FD);
+      CurFunction = SavedFunction;
+      return Result;
+    }
+    bool TraverseUPCForAllStmt(UPCForAllStmt *S) {
+      if(!S->getAfnty())
+        return Base::TraverseUPCForAllStmt(S);
+      ++ForAllHeaderDepth;
+      TraverseStmt(S->getInit());
+      TraverseStmt(S->getCond());
+      TraverseStmt(S->getInc());
+      TraverseStmt(S->getAfnty());
+      --ForAllHeaderDepth;
+      ++ForAllDepth;
+      TraverseStmt(S->getBody());
+      --ForAllDepth;
+      return true;
+    }
+    bool VisitCallExpr(CallExpr *E) {
+      // Children are visited after their parents, so the callee
+      // is known not to have its address taken by the time we
+      // reach the DeclRefExpr.
+      if(DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(E->getCallee()->IgnoreParenImpCasts())) {
+        if(FunctionDecl *Callee = dyn_cast<FunctionDecl>(DRE->getDecl())) {
+          DirectCallees.insert(DRE);
+          Functions[Callee->getCanonicalDecl()].CallSites.push_back(CallSite(CurFunction, ForAllDepth > 0, ForAllHeaderDepth > 0));
+        }
+      }
+      return true;
+    }
+    bool VisitDeclRefExpr(DeclRefExpr *E) {
+      if(FunctionDecl *FD = dyn_cast<FunctionDecl>(E->getDecl())) {
+        if(DirectCallees.find(E) == DirectCallees.end())
+          Functions[FD->getCanonicalDecl()].AddressTaken = true;
+      }
+      return true;
+    }
+    static ForAllContext Join(ForAllContext LHS, ForAllContext RHS) {
+      if(LHS == FAC_Undetermined) return RHS;
+      if(RHS == FAC_Undetermined || LHS == RHS) return LHS;
+      return FAC_Unknown;
+    }
+    bool isMain(FunctionDecl *FD) {
+      IdentifierInfo *II = FD->getIdentifier();
+      return II && II->isStr("main");
+    }
+    ForAllContext ComputeContext(FunctionDecl *FD, const FunctionInfo& Info) {
+      // Functions that can be called from other translation
+      // units or through a pointer have unknown callers.
+      if(Info.AddressTaken ||
+         (!isMain(FD) && FD->isExternallyVisible() && !FD->isInlineSpecified()))
+        return FAC_Unknown;
+      // The runtime calls main outside of any upc_forall.
+      ForAllContext Result = isMain(FD)? FAC_Outside : FAC_Undetermined;
+      for(std::vector<CallSite>::const_iterator iter = Info.CallSites.begin(), end = Info.CallSites.end(); iter != end; ++iter) {
+        ForAllContext Site;
+        if(iter->InsideForAll) {
+          Site = FAC_Inside;
+        } else if(iter->InForAllHeader) {
+          Site = FAC_Unknown;
+        } else if(iter->Caller) {
+          Site = Functions[iter->Caller].Context;
+        } else {
+          Site = FAC_Unknown;
+        }
+        Result = Join(Result, Site);
+      }
+      return Result;
+    }
+    // Propagate the contexts of the call sites to the callees
+    // until nothing changes.  Contexts only move up the lattice,
+    // so this terminates.
+    void Solve() {
+      bool Changed = true;
+      while(Changed) {
+        Changed = false;
+        for(FunctionMap::iterator iter = Functions.begin(), end = Functions.end(); iter != end; ++iter) {
+          ForAllContext NewContext = ComputeContext(iter->first, iter->second);
+          if(NewContext != iter->second.Context) {
+            iter->second.Context = NewContext;
+            Changed = true;
+          }
+        }
+      }
+    }
+    ForAllContext getForAllContext(FunctionDecl *FD) {
+      FunctionMap::const_iterator pos = Functions.find(FD->getCanonicalDecl());
+      if(pos == Functions.end())
+        return FAC_Unknown;
+      // Functions that are never called can be treated either way.
+      if(pos->second.Context == FAC_Undetermined)
+        return FAC_Outside;
+      return pos->second.Context;
+    }
+    typedef std::map<FunctionDecl*, FunctionInfo> FunctionMap;
+    FunctionMap Functions;
+  private:
+    std::set<DeclRefExpr*> DirectCallees;
+    FunctionDecl *CurFunction;
+    int ForAllDepth;
+    int ForAllHeaderDepth;
+  };
+
   class RemoveUPCTransform : public clang::TreeTransform<RemoveUPCTransform> {
     typedef TreeTransform<RemoveUPCTransform> TreeTransformUPC;
   private:
     bool haveOffsetOf;
     bool haveVAArg;
+    bool haveGather;
   public:
-    RemoveUPCTransform(Sema& S, UPCRDecls* D, const std::string& fileid)
-      : TreeTransformUPC(S), AnonRecordID(0), StaticLocalVarID(0),
-        Decls(D), FileString(fileid) {
-      haveOffsetOf = haveVAArg = false;
+    RemoveUPCTransform(Sema& S, UPCRDecls* D, const std::string& fileid, const UPCTransformOptions& Opts)
+      : TreeTransformUPC(S), InFunctionBody(false), CachedThreads(NULL),
+        CachedMyThread(NULL), AnonRecordID(0), StaticLocalVarID(0),
+        DeferPuts(false), StmtExprResult(NULL), FunctionHasSplitBarrier(false),
+        StmtExprDepth(0),
+        CurForAllContext(UPCCallGraph::FAC_Unknown), ForAllDepth(0),
+        NeedsFunctionFrame(true), Decls(D), FileString(fileid), Options(Opts) {
+      haveOffsetOf = haveVAArg = haveGather = false;
     }
     bool HaveOffsetOf() { return haveOffsetOf; }
     ExprResult TransformOffsetOfExpr(OffsetOfExpr *E) {
@@ -556,6 +1783,7 @@ namespace {
       return TreeTransformUPC::TransformOffsetOfExpr(E);
     }
     bool HaveVAArg() { return haveVAArg; }
+    bool HaveGather() { return haveGather; }
     ExprResult TransformVAArgExpr(VAArgExpr *E) {
       haveVAArg = true;
       return TreeTransformUPC::TransformVAArgExpr(E);
@@ -578,6 +1806,34 @@ namespace {
     ExprResult BuildUPCRCall(FunctionDecl *FD, std::vector<Expr*>& args) {
       return BuildUPCRCall(FD, args, SourceLocation());
     }
+    // THREADS, either as a constant or as a call to upcr_threads
+    Expr *BuildUPCRThreads() {
+      if(Options.StaticThreads) {
+	return CreateInteger(SemaRef.Context.IntTy, Options.StaticThreads);
+      }
+      std::vector<Expr*> args;
+      return CacheOnEntry(CachedThreads, BuildUPCRCall(Decls->upcr_threads, args).get());
+    }
+    Expr *BuildUPCRMyThread() {
+      std::vector<Expr*> args;
+      return CacheOnEntry(CachedMyThread, BuildUPCRCall(Decls->upcr_mythread, args).get());
+    }
+    // Values that don't change during a call are computed once,
+    // after UPCR_BEGIN_FUNCTION, and kept in temporaries.
+    bool InFunctionBody;
+    VarDecl *CachedThreads;
+    VarDecl *CachedMyThread;
+    std::map<Decl*, VarDecl*> CachedTLDAddrs;
+    std::vector<Stmt*> EntryInits;
+    Expr *CacheOnEntry(VarDecl *&Var, Expr *Value) {
+      if(!InFunctionBody)
+	return Value;
+      if(!Var) {
+	Var = CreateTmpVar(Value->getType());
+	EntryInits.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(Var), Value).get());
+      }
+      return CreateSimpleDeclRef(Var);
+    }
     ExprResult BuildUPCRDeclRef(VarDecl *VD) {
       return SemaRef.BuildDeclRefExpr(VD, VD->getType(), VK_LValue, SourceLocation());
     }
@@ -609,7 +1865,11 @@ namespace {
 	  Result.ArrayDimension *= CAT->getSize();
 	} else if(const UPCThreadArrayType *TAT = dyn_cast<UPCThreadArrayType>(AT)) {
 	  if(TAT->getThread()) {
-	    Result.HasThread = true;
+	    if(Options.StaticThreads) {
+	      Result.ArrayDimension *= Options.StaticThreads;
+	    } else {
+	      Result.HasThread = true;
+	    }
 	  }
 	  Result.ArrayDimension *= TAT->getSize();
 	} else if(const VariableArrayType *VAT = dyn_cast<VariableArrayType>(AT)) {
@@ -639,11 +1899,14 @@ namespace {
     ExprResult MaybeAdjustForArray(const ArrayDimensionT & Dims, Expr * E, BinaryOperatorKind Op) {
       if(Dims.ArrayDimension == 1 && !Dims.E && !Dims.HasThread) {
 	return E;
+      } else if(Op == BO_Mul && !Dims.E && !Dims.HasThread && isa<IntegerLiteral>(E->IgnoreParens())) {
+	// Fold constant indices
+	llvm::APInt Value = cast<IntegerLiteral>(E->IgnoreParens())->getValue().zextOrTrunc(Dims.ArrayDimension.getBitWidth());
+	return IntegerLiteral::Create(SemaRef.Context, Value * Dims.ArrayDimension, SemaRef.Context.getSizeType(), SourceLocation());
       } else {
 	Expr *Dimension = IntegerLiteral::Create(SemaRef.Context, Dims.ArrayDimension, SemaRef.Context.getSizeType(), SourceLocation());
 	if(Dims.HasThread) {
-	  std::vector<Expr*> args;
-	  Expr *Threads = BuildUPCRCall(Decls->upcr_threads, args).get();
+	  Expr *Threads = BuildUPCRThreads();
 	  Dimension = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Mul, Dimension, Threads).get();
 	}
 	if(Dims.E) {
@@ -698,19 +1961,90 @@ namespace {
       Stmt *result = BuildUPCRCall(Decls->upcr_barrier, args, S->getLocStart()).get();
       return result;
     }
+    Expr *BuildUPCRBarrierCall(FunctionDecl *FD, UPCBarrierStmt *S) {
+      std::vector<Expr*> args = BuildUPCBarrierArgs(S->getIdValue());
+      return BuildUPCRCall(FD, args, S->getLocStart()).get();
+    }
+    // Whether a statement can run between the notify and the wait
+    // of a barrier: a declaration or expression that touches no
+    // shared data and makes no calls.
+    bool isPrivateStmt(Stmt *S) {
+      if(S == StmtExprResult)
+	return false;
+      if(ElidedBarriers.count(S))
+	return true;
+      if(DeclStmt *DS = dyn_cast<DeclStmt>(S)) {
+	for(DeclStmt::decl_iterator D = DS->decl_begin(), DEnd = DS->decl_end(); D != DEnd; ++D) {
+	  VarDecl *VD = dyn_cast<VarDecl>(*D);
+	  if(!VD || !VD->hasLocalStorage() || VD->getType().getQualifiers().hasShared() ||
+	     VD->getType()->isVariablyModifiedType())
+	    return false;
+	}
+      } else if(!isa<Expr>(S) && !isa<NullStmt>(S)) {
+	return false;
+      }
+      CheckForNonPrivateAccess Check(SemaRef.Context);
+      Check.TraverseStmt(S);
+      return !Check.Found;
+    }
+    // Barriers that are removed because a neighbouring barrier
+    // provides the same ordering
+    std::set<Stmt*> ElidedBarriers;
+    // In a run of barriers of S separated only by private
+    // statements, one barrier is enough.  Barriers with an id are
+    // kept, since threads elsewhere may be matching them.
+    void FindRedundantBarriers(CompoundStmt *S) {
+      std::vector<UPCBarrierStmt*> Run;
+      bool HasID = false;
+      for (unsigned i = 0; i <= S->size(); ++i) {
+	Stmt *Child = i < S->size()? S->body_begin()[i] : NULL;
+	if (UPCBarrierStmt *B = dyn_cast_or_null<UPCBarrierStmt>(Child)) {
+	  Run.push_back(B);
+	  HasID = HasID || B->getIdValue();
+	  continue;
+	}
+	if (Child && isPrivateStmt(Child))
+	  continue;
+	for (std::size_t j = 0; j < Run.size(); ++j) {
+	  if (!Run[j]->getIdValue() && (HasID || j > 0))
+	    ElidedBarriers.insert(Run[j]);
+	}
+	Run.clear();
+	HasID = false;
+      }
+    }
+    // Finds the private statements around the barrier at Index of
+    // S, from no earlier than First.  The notify goes in front of
+    // Begin and the wait after End.  The id is evaluated by both,
+    // so it must be a constant.
+    bool FindSplitBarrier(CompoundStmt *S, unsigned Index, unsigned First, unsigned &Begin, unsigned &End) {
+      UPCBarrierStmt *B = dyn_cast<UPCBarrierStmt>(S->body_begin()[Index]);
+      if(!B || ElidedBarriers.count(B))
+	return false;
+      Expr *ID = B->getIdValue();
+      if(ID && !ID->isIntegerConstantExpr(SemaRef.Context))
+	return false;
+      Begin = End = Index;
+      while(Begin > First && isPrivateStmt(S->body_begin()[Begin - 1]))
+	--Begin;
+      while(End + 1 < S->size() && isPrivateStmt(S->body_begin()[End + 1]))
+	++End;
+      return Begin != Index || End != Index;
+    }
     StmtResult TransformUPCFenceStmt(UPCFenceStmt *S) {
       std::vector<Expr*> args;
       Stmt *result = BuildUPCRCall(Decls->upcr_poll, args, S->getLocStart()).get();
       return result;
     }
     ExprResult TransformUPCThreadExpr(UPCThreadExpr *E) {
-      std::vector<Expr*> args;
-      Expr *Call = BuildUPCRCall(Decls->upcr_threads, args).get();
+      if(Options.StaticThreads) {
+	return BuildUPCRThreads();
+      }
+      Expr *Call = BuildUPCRThreads();
       return SemaRef.BuildCStyleCastExpr(SourceLocation(), SemaRef.Context.getTrivialTypeSourceInfo(SemaRef.Context.IntTy), SourceLocation(), Call);
     }
     ExprResult TransformUPCMyThreadExpr(UPCMyThreadExpr *E) {
-      std::vector<Expr*> args;
-      Expr *Call = BuildUPCRCall(Decls->upcr_mythread, args).get();
+      Expr *Call = BuildUPCRMyThread();
       return SemaRef.BuildCStyleCastExpr(SourceLocation(), SemaRef.Context.getTrivialTypeSourceInfo(SemaRef.Context.IntTy), SourceLocation(), Call);
     }
     ExprResult TransformInitializer(Expr *Init, bool CXXDirectInit) {
@@ -754,6 +2088,27 @@ namespace {
       }
     }
     ExprResult TransformImplicitCastExpr(ImplicitCastExpr *E) {
+      std::map<Expr*, std::pair<VarDecl*, VarDecl*> >::iterator Gathered = GatheredLoads.find(E);
+      if(Gathered != GatheredLoads.end()) {
+	return SemaRef.CreateBuiltinArraySubscriptExpr(CreateSimpleDeclRef(Gathered->second.first), SourceLocation(), CreateSimpleDeclRef(Gathered->second.second), SourceLocation());
+      }
+      std::map<Expr*, int64_t>::iterator Neighbor = HaloReads.find(E);
+      if(Neighbor != HaloReads.end()) {
+	return BuildHaloRead(Neighbor->second);
+      }
+      std::map<Expr*, VarDecl*>::iterator Reused = ReusedLoads.find(E);
+      if(Reused != ReusedLoads.end()) {
+	return CreateSimpleDeclRef(Reused->second);
+      }
+      std::map<Expr*, StagedAccess>::iterator Staged = StagedLoads.find(E);
+      if(Staged != StagedLoads.end()) {
+	return BuildStagedAccess(Staged->second);
+      }
+      if(E->getCastKind() == CK_LValueToRValue) {
+	if(PromotedScalar *P = FindPromoted(E->getSubExpr())) {
+	  return CreateSimpleDeclRef(P->Value);
+	}
+      }
       if(E->getCastKind() == CK_LValueToRValue && E->getSubExpr()->getType().getQualifiers().hasShared()) {
 	return BuildUPCRLoad(TransformExpr(E->getSubExpr()).get(), E->getSubExpr()->getType());
       } else {
@@ -790,6 +2145,74 @@ namespace {
              ((Ty->isIntegralOrEnumerationType() || Ty->isPointerType()) &&
               (SemaRef.Context.getTypeSize(Ty) <= SemaRef.Context.getTypeSize(Decls->upcr_register_value_t)));
     }
+    bool hasConstFields(const RecordDecl *RD) {
+      for(RecordDecl::field_iterator iter = RD->field_begin(), end = RD->field_end(); iter != end; ++iter) {
+        QualType FieldTy = SemaRef.Context.getBaseElementType(iter->getType());
+        if(FieldTy.isConstQualified()) return true;
+        if(const RecordType *RT = FieldTy->getAs<RecordType>())
+          if(hasConstFields(RT->getDecl())) return true;
+      }
+      return false;
+    }
+    // Pointers-to-shared and small structs can't be cast to
+    // upcr_register_value_t, but they can still be transferred
+    // by value through a union with an integer of the same size.
+    // Returns that integer type, or a null type if Ty doesn't fit.
+    QualType getUPCRPunType(QualType Ty) {
+      ASTContext& Context = SemaRef.Context;
+      if(!isPointerToShared(Ty)) {
+        const RecordType *RT = Ty->getAs<RecordType>();
+        if(!RT || !RT->getDecl()->getDefinition() ||
+           RT->getDecl()->hasFlexibleArrayMember() || hasConstFields(RT->getDecl()))
+          return QualType();
+        // The runtime accesses the value as a single aligned word
+        if(Context.getTypeAlign(Ty) < Context.getTypeSize(Ty))
+          return QualType();
+      }
+      uint64_t Size = Context.getTypeSize(Ty);
+      if(Size > Context.getTypeSize(Decls->upcr_register_value_t))
+        return QualType();
+      QualType IntTypes[] = { Context.UnsignedCharTy, Context.UnsignedShortTy, Context.UnsignedIntTy,
+                              Context.UnsignedLongTy, Context.UnsignedLongLongTy };
+      for(std::size_t i = 0; i < sizeof(IntTypes)/sizeof(IntTypes[0]); ++i) {
+        if(Context.getTypeSize(IntTypes[i]) == Size)
+          return IntTypes[i];
+      }
+      return QualType();
+    }
+    // union _bupc_punN { IntTy _bupc_v; Ty _bupc_t; }, created once per type
+    RecordDecl *GetUPCRPunUnion(QualType Ty, QualType IntTy) {
+      RecordDecl *&Result = PunUnions[SemaRef.Context.getCanonicalType(Ty).getAsOpaquePtr()];
+      if(Result) return Result;
+      ASTContext& Context = SemaRef.Context;
+      TranslationUnitDecl *TU = Context.getTranslationUnitDecl();
+      std::string Name = (Twine("_bupc_pun") + Twine(AnonRecordID++)).str();
+      Result = RecordDecl::Create(Context, TTK_Union, TU, SourceLocation(), SourceLocation(),
+                                  &Context.Idents.get(Name));
+      Result->startDefinition();
+      QualType FieldTypes[] = { IntTy, MakeTypedefForAnonRecord(Ty) };
+      const char *FieldNames[] = { "_bupc_v", "_bupc_t" };
+      for(int i = 0; i < 2; ++i) {
+        FieldDecl *FD = FieldDecl::Create(Context, Result, SourceLocation(), SourceLocation(),
+                                          &Context.Idents.get(FieldNames[i]), FieldTypes[i],
+                                          Context.getTrivialTypeSourceInfo(FieldTypes[i]),
+                                          NULL, false, ICIS_NoInit);
+        FD->setAccess(AS_public);
+        Result->addDecl(FD);
+      }
+      Result->completeDefinition();
+      LocalStatics.push_back(Result);
+      return Result;
+    }
+    // Field 0 is the integer, field 1 the value
+    Expr *BuildUPCRPunField(VarDecl *Tmp, int Index) {
+      RecordDecl *RD = Tmp->getType()->getAs<RecordType>()->getDecl();
+      RecordDecl::field_iterator FD = RD->field_begin();
+      if(Index) ++FD;
+      return MemberExpr::Create(SemaRef.Context, CreateSimpleDeclRef(Tmp), false, SourceLocation(), NestedNameSpecifierLoc(), SourceLocation(),
+				*FD, DeclAccessPair::make(*FD, FD->getAccess()), DeclarationNameInfo(FD->getDeclName(), SourceLocation()),
+				NULL, FD->getType(), VK_LValue, OK_Ordinary);
+    }
     Expr *FoldUPCRLoadStore(Expr* &E, bool &Phaseless) {
       Expr *Offset = NULL;
       while (CallExpr *CE = dyn_cast<CallExpr>(E->IgnoreParens())) {
@@ -859,11 +2282,28 @@ namespace {
 	  Result = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, LoadVar, Result).get();
 	}
 	Result = BuildParens(Result).get();
+      } else if(!getUPCRPunType(ResultType).isNull()) {
+	// Case 1a.  Get by value into the integer half of a union
+	QualType IntTy = getUPCRPunType(ResultType);
+	RecordDecl *Pun = GetUPCRPunUnion(ResultType, IntTy);
+	VarDecl *TmpVar = CreateTmpVar(SemaRef.Context.getRecordType(Pun), true);
+	args.push_back(Ptr);
+	args.push_back(Offset);
+	args.push_back(CreateInteger(SemaRef.Context.getSizeType(),SemaRef.Context.getTypeSizeInChars(Ty).getQuantity()));
+	Result = BuildUPCRCall(Decls->UPCR_GET_IVAL(Phaseless,Strict), args).get();
+	TypeSourceInfo *CastTo = SemaRef.Context.getTrivialTypeSourceInfo(IntTy);
+	Result = SemaRef.BuildCStyleCastExpr(SourceLocation(), CastTo, SourceLocation(), Result).get();
+	Result = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, BuildUPCRPunField(TmpVar, 0), Result).get();
+	Expr *Value = BuildUPCRPunField(TmpVar, 1);
+	if(LoadVar) {
+	  Value = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, LoadVar, Value).get();
+	}
+	Result = BuildParens(BuildComma(Result, Value).get()).get();
       } else {
 	// Case 2.  Get by reference, to callers LoadVar if passed
 	VarDecl *TmpVar = NULL;
 	if (!LoadVar) { // Create a LoadVar if the caller doesn't provide one
-	  TmpVar = CreateTmpVar(ResultType);
+	  TmpVar = CreateTmpVar(ResultType, true);
 	  LoadVar = CreateSimpleDeclRef(TmpVar);
 	}
 	args.push_back(SemaRef.CreateBuiltinUnaryOp(SourceLocation(), UO_AddrOf, LoadVar).get());
@@ -875,6 +2315,50 @@ namespace {
       }
       return Result;
     }
+    // Non-blocking gets return the value through the handle if
+    // it fits, and otherwise into LoadVar.
+    bool isNBValueGet(QualType ResultType) {
+      return typeFitsUPCRValuePutGet(ResultType) &&
+	!ResultType->isSpecificBuiltinType(BuiltinType::Float) &&
+	!ResultType->isSpecificBuiltinType(BuiltinType::Double);
+    }
+    // Starts a relaxed get of a shared location into LoadVar, storing
+    // the handle for the operation in HandleVar.  The value may not be
+    // used until after the statement built by BuildUPCRLoadSync.
+    Expr *BuildUPCRLoadInit(Expr * Ptr, QualType Ty, Expr * HandleVar, Expr * LoadVar) {
+      bool Phaseless = isPhaseless(Ty);
+      Expr *Offset = FoldUPCRLoadStore(Ptr, Phaseless);
+      QualType ResultType = TransformType(Ty).getUnqualifiedType();
+      std::vector<Expr*> args;
+      Expr *Result;
+      if(isNBValueGet(ResultType)) {
+	args.push_back(Ptr);
+	args.push_back(Offset);
+	args.push_back(CreateInteger(SemaRef.Context.getSizeType(),SemaRef.Context.getTypeSizeInChars(Ty).getQuantity()));
+	Result = BuildUPCRCall(Decls->UPCR_GET_NB_VAL(Phaseless), args).get();
+      } else {
+	args.push_back(SemaRef.CreateBuiltinUnaryOp(SourceLocation(), UO_AddrOf, LoadVar).get());
+	args.push_back(Ptr);
+	args.push_back(Offset);
+	args.push_back(CreateInteger(SemaRef.Context.getSizeType(),SemaRef.Context.getTypeSizeInChars(Ty).getQuantity()));
+	Result = BuildUPCRCall(Decls->UPCR_GET_NB(Phaseless), args).get();
+      }
+      return SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, HandleVar, Result).get();
+    }
+    // Waits for a get started by BuildUPCRLoadInit
+    Expr *BuildUPCRLoadSync(QualType Ty, Expr * HandleVar, Expr * LoadVar) {
+      QualType ResultType = TransformType(Ty).getUnqualifiedType();
+      std::vector<Expr*> args;
+      args.push_back(HandleVar);
+      if(isNBValueGet(ResultType)) {
+	Expr *Result = BuildUPCRCall(Decls->upcr_wait_syncnb_valget, args).get();
+	TypeSourceInfo *CastTo = SemaRef.Context.getTrivialTypeSourceInfo(ResultType);
+	Result = SemaRef.BuildCStyleCastExpr(SourceLocation(), CastTo, SourceLocation(), Result).get();
+	return SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, LoadVar, Result).get();
+      } else {
+	return BuildUPCRCall(Decls->upcr_wait_syncnb, args).get();
+      }
+    }
     ExprResult BuildUPCRSharedToPshared(Expr *Ptr) {
       CallExpr *CE = dyn_cast<CallExpr>(Ptr->IgnoreParens());
       FunctionDecl *Child = CE? CE->getDirectCallee() : 0;
@@ -955,17 +2439,21 @@ namespace {
       Qualifiers Quals = Ty.getQualifiers(); 
       bool Phaseless = isPhaseless(Ty);
       bool Strict = Quals.hasStrict();
+      // Non-blocking puts may reuse the source as soon as they return
+      bool NonBlocking = DeferPuts && !Strict;
       // Try to fold offset and phased/phaseless conversions:
       Expr *Offset = FoldUPCRLoadStore(LHS, Phaseless);
       // Select the default function to call
-      UPCRCommFn *Accessor = &Decls->UPCR_PUT;
+      UPCRCommFn *Accessor = NonBlocking? &Decls->UPCR_PUT_NBI : &Decls->UPCR_PUT;
       Expr *SetTmp = NULL;
       Expr *SrcArg = NULL;
       Expr *RetVal = NULL;
       bool NeedSize = true;
       QualType ResultType = TransformType(Ty).getUnqualifiedType();
       QualType RHSType = RHS->getType().getUnqualifiedType();
-      if(typeFitsUPCRValuePutGet(ResultType)) {
+      // There are no non-blocking puts of float or double values
+      if(typeFitsUPCRValuePutGet(ResultType) &&
+	 (!NonBlocking || isNBValueGet(ResultType))) {
 	if (RHS->isLValue() && !ReturnValue) {
 	  // Case 1. Put RHS by value, with type cast if necessary
 	  SrcArg = RHS;
@@ -976,7 +2464,7 @@ namespace {
 	} else {
 	  // Case 2. Store value of RHS in a temporary. which is Put by value
 	  // If(ReturnValue) then the temporary's value is returned
-	  VarDecl *TmpVar = CreateTmpVar(ResultType);
+	  VarDecl *TmpVar = CreateTmpVar(ResultType, true);
 	  SetTmp = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(TmpVar), RHS).get();
 	  SrcArg = CreateSimpleDeclRef(TmpVar);
 	  if(ReturnValue) RetVal = CreateSimpleDeclRef(TmpVar);
@@ -990,16 +2478,27 @@ namespace {
 	} else {
 	  TypeSourceInfo *TSI = SemaRef.Context.getTrivialTypeSourceInfo(Decls->upcr_register_value_t);
 	  SrcArg = SemaRef.BuildCStyleCastExpr(SourceLocation(), TSI, SourceLocation(), SrcArg).get();
-	  Accessor = &Decls->UPCR_PUT_IVAL;
+	  Accessor = NonBlocking? &Decls->UPCR_PUT_NBI_VAL : &Decls->UPCR_PUT_IVAL;
 	}
+      } else if(!getUPCRPunType(ResultType).isNull()) {
+	// Case 2a. Store value of RHS in a union, whose integer half is Put by value
+	QualType IntTy = getUPCRPunType(ResultType);
+	RecordDecl *Pun = GetUPCRPunUnion(ResultType, IntTy);
+	VarDecl *TmpVar = CreateTmpVar(SemaRef.Context.getRecordType(Pun), true);
+	SetTmp = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, BuildUPCRPunField(TmpVar, 1), RHS).get();
+	TypeSourceInfo *TSI = SemaRef.Context.getTrivialTypeSourceInfo(Decls->upcr_register_value_t);
+	SrcArg = SemaRef.BuildCStyleCastExpr(SourceLocation(), TSI, SourceLocation(), BuildUPCRPunField(TmpVar, 0)).get();
+	if(ReturnValue) RetVal = BuildUPCRPunField(TmpVar, 1);
+	Accessor = NonBlocking? &Decls->UPCR_PUT_NBI_VAL : &Decls->UPCR_PUT_IVAL;
       } else if (RHS->isLValue() && !ReturnValue &&
 		 SemaRef.Context.typesAreCompatible(ResultType, RHSType)) {
 	// Case 3. Put RHS by reference (safe because no return or type conversion required)
 	SrcArg = SemaRef.CreateBuiltinUnaryOp(SourceLocation(), UO_AddrOf, RHS).get();
       } else {
 	// Case 4. Store value of RHS in a temporary which is Put by reference
-	// If(ReturnValue) then the temporary's value is returned
-	VarDecl *TmpVar = CreateTmpVar(ResultType);
+	// If(ReturnValue) then the temporary's value is returned.
+	// A non-blocking put reads it after the statement.
+	VarDecl *TmpVar = CreateTmpVar(ResultType, !NonBlocking);
 	SetTmp = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(TmpVar), RHS).get();
 	SrcArg = SemaRef.CreateBuiltinUnaryOp(SourceLocation(), UO_AddrOf, CreateSimpleDeclRef(TmpVar)).get();
 	if(ReturnValue) RetVal = CreateSimpleDeclRef(TmpVar);
@@ -1027,7 +2526,8 @@ namespace {
 	  Ptr = CE->getArg(0);
 	  if(isLiteralInt(CE->getArg(1),ElemSz)) {
 	    // Can fold simply if ElemSz matches:
-	    Inc = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Add, Inc, CE->getArg(2)).get();
+	    Inc = BuildIncrementSum(Inc, CE->getArg(2));
+	    if(isLiteralInt(Inc,0)) return Ptr;
 	  } else {
 	    // Can fold other cases with some extra work:
 	    Expr *Op1 = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Mul,
@@ -1053,7 +2553,8 @@ namespace {
 	if((CE->getDirectCallee() == Decls->UPCR_ADD_PSHARED1) &&
 	   isLiteralInt(CE->getArg(1),ElemSz)) {
 	  Ptr = CE->getArg(0);
-	  Inc = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Add, Inc, CE->getArg(2)).get();
+	  Inc = BuildIncrementSum(Inc, CE->getArg(2));
+	  if(isLiteralInt(Inc,0)) return Ptr;
 	}
       }
       std::vector<Expr*> args;
@@ -1062,6 +2563,17 @@ namespace {
       args.push_back(Inc);
       return BuildUPCRCall(Decls->UPCR_ADD_PSHARED1, args);
     }
+    // Adds two increments, folding them if both are constant
+    Expr *BuildIncrementSum(Expr *LHS, Expr *RHS) {
+      IntegerLiteral *LHSLit = dyn_cast<IntegerLiteral>(LHS->IgnoreParens());
+      IntegerLiteral *RHSLit = dyn_cast<IntegerLiteral>(RHS->IgnoreParens());
+      if(LHSLit && RHSLit) {
+	unsigned Width = SemaRef.Context.getTypeSize(SemaRef.Context.getSizeType());
+	llvm::APInt Value = LHSLit->getValue().zextOrTrunc(Width) + RHSLit->getValue().zextOrTrunc(Width);
+	return IntegerLiteral::Create(SemaRef.Context, Value, SemaRef.Context.getSizeType(), SourceLocation());
+      }
+      return SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Add, LHS, RHS).get();
+    }
     ExprResult BuildUPCRAddShared(Expr *Ptr, int64_t ElemSz, Expr *Inc, uint32_t BlockSz) {
       if(isLiteralInt(Inc,0)) return Ptr; // No-op
       if(CallExpr *CE = dyn_cast<CallExpr>(Ptr->IgnoreParens())) {
@@ -1069,7 +2581,8 @@ namespace {
 	if((CE->getDirectCallee() == Decls->UPCR_ADD_SHARED) &&
 	   isLiteralInt(CE->getArg(1),ElemSz) && isLiteralInt(CE->getArg(3),BlockSz)) {
 	  Ptr = CE->getArg(0);
-	  Inc = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Add, Inc, CE->getArg(2)).get();
+	  Inc = BuildIncrementSum(Inc, CE->getArg(2));
+	  if(isLiteralInt(Inc,0)) return Ptr;
 	}
       }
       std::vector<Expr*> args;
@@ -1093,6 +2606,28 @@ namespace {
 	return BuildUPCRAddShared(Ptr, ElementSize, IntVal, LayoutQualifier);
       }
     }
+    // Increments a private pointer-to-shared in place.  The runtime
+    // carries the phase and thread incrementally instead of
+    // recomputing them from scratch as upcr_add_shared does.
+    ExprResult CreateUPCPointerIncrement(Expr *Ptr, Expr *IntVal, QualType PtrTy) {
+      QualType PointeeType = PtrTy->getAs<PointerType>()->getPointeeType();
+      ArrayDimensionT Dims = GetArrayDimension(PointeeType);
+      int64_t ElementSize = Dims.ElementSize;
+      IntVal = MaybeAdjustForArray(Dims, IntVal, BO_Mul).get();
+      uint32_t LayoutQualifier = PointeeType.getQualifiers().getLayoutQualifier();
+      std::vector<Expr*> args;
+      args.push_back(SemaRef.CreateBuiltinUnaryOp(SourceLocation(), UO_AddrOf, BuildParens(Ptr).get()).get());
+      args.push_back(CreateInteger(SemaRef.Context.getSizeType(), ElementSize));
+      args.push_back(IntVal);
+      if(LayoutQualifier == 0) {
+	return BuildUPCRCall(Decls->UPCR_INC_PSHAREDI, args);
+      } else if(isPhaseless(PointeeType) && LayoutQualifier == 1) {
+	return BuildUPCRCall(Decls->UPCR_INC_PSHARED1, args);
+      } else {
+	args.push_back(CreateInteger(SemaRef.Context.getSizeType(), LayoutQualifier));
+	return BuildUPCRCall(Decls->UPCR_INC_SHARED, args);
+      }
+    }
     ExprResult CreateArithmeticExpr(Expr *LHS, Expr *RHS, QualType LHSTy, BinaryOperatorKind Op) {
       if(isPointerToShared(LHSTy)) {
 	if(Op == BO_Sub) {
@@ -1110,14 +2645,22 @@ namespace {
 	// Strip off * and &.  shared lvalues and pointers-to-shared
 	// have the same representation.
 	return TransformExpr(E->getSubExpr());
+      } else if(ArgType.getQualifiers().hasShared() && E->isIncrementDecrementOp() && FindPromoted(E->getSubExpr())) {
+	PromotedScalar *P = FindPromoted(E->getSubExpr());
+	return BuildPromotedStore(*P, SemaRef.CreateBuiltinUnaryOp(SourceLocation(), E->getOpcode(), CreateSimpleDeclRef(P->Value)).get());
+      } else if(ArgType.getQualifiers().hasShared() && E->isIncrementDecrementOp() &&
+		isAtomicUpdate(E, E->getSubExpr(), E->isIncrementOp()? BO_Add : BO_Sub, NULL)) {
+	// x++ as a statement
+	Expr *Ptr = TransformExpr(E->getSubExpr()).get();
+	return BuildUPCRAtomicUpdate(Ptr, ArgType, BO_Add, CreateInteger(SemaRef.Context.IntTy, E->isIncrementOp()? 1 : -1));
       } else if(ArgType.getQualifiers().hasShared() && E->isIncrementDecrementOp()) {
 	bool Phaseless = isPhaseless(ArgType);
 	QualType PtrType = Phaseless? Decls->upcr_pshared_ptr_t : Decls->upcr_shared_ptr_t;
-	VarDecl * TmpPtrDecl = CreateTmpVar(PtrType);
+	VarDecl * TmpPtrDecl = CreateTmpVar(PtrType, true);
 	Expr * TmpPtr = SemaRef.BuildDeclRefExpr(TmpPtrDecl, PtrType, VK_LValue, SourceLocation()).get();
 	Expr * SaveArg = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, TmpPtr, BuildParens(TransformExpr(E->getSubExpr()).get()).get()).get();
 	QualType ResultType = TransformType(ArgType.getUnqualifiedType());
-	Expr * LoadVar = CreateSimpleDeclRef(CreateTmpVar(ResultType));
+	Expr * LoadVar = CreateSimpleDeclRef(CreateTmpVar(ResultType, true));
 	Expr * LoadExpr = BuildUPCRLoad(TmpPtr, ArgType, LoadVar);
 	Expr * NewVal = CreateArithmeticExpr(LoadVar, CreateInteger(SemaRef.Context.IntTy, 1), ArgType, E->isIncrementOp()?BO_Add:BO_Sub).get();
 
@@ -1128,14 +2671,18 @@ namespace {
 	  Expr * Result = BuildUPCRStore(TmpPtr, NewVal, ArgType, false).get();
 	  return BuildParens(BuildComma(SaveArg, BuildComma(LoadExpr, BuildComma(Result, LoadVar).get()).get()).get());
 	}
+      } else if(isPointerToShared(ArgType) && E->isIncrementDecrementOp() && isResultUnused(E)) {
+	// p++ as a statement, e.g. the increment of a loop walking an array
+	Expr *IntVal = CreateInteger(SemaRef.Context.IntTy, E->isIncrementOp()? 1 : -1);
+	return CreateUPCPointerIncrement(TransformExpr(E->getSubExpr()).get(), IntVal, ArgType);
       } else if(isPointerToShared(ArgType) && E->isIncrementDecrementOp()) {
 	QualType TmpPtrType = SemaRef.Context.getPointerType(TransformType(ArgType));
-	VarDecl * TmpPtrDecl = CreateTmpVar(TmpPtrType);
+	VarDecl * TmpPtrDecl = CreateTmpVar(TmpPtrType, true);
 	Expr * TmpPtr = CreateSimpleDeclRef(TmpPtrDecl);
         Expr * Setup = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, TmpPtr, SemaRef.CreateBuiltinUnaryOp(SourceLocation(), UO_AddrOf, TransformExpr(E->getSubExpr()).get()).get()).get();
 	Expr * Access = SemaRef.CreateBuiltinUnaryOp(SourceLocation(), UO_Deref, TmpPtr).get();
 
-	VarDecl * TmpValDecl = CreateTmpVar(TransformType(ArgType).getUnqualifiedType());
+	VarDecl * TmpValDecl = CreateTmpVar(TransformType(ArgType).getUnqualifiedType(), true);
 	Expr * TmpVal = CreateSimpleDeclRef(TmpValDecl);
 	Expr * Expr1;
 	Expr * Expr2;
@@ -1161,9 +2708,574 @@ namespace {
 	return TreeTransformUPC::TransformUnaryOperator(E);
       }
     }
+    // Set while transforming a statement whose relaxed
+    // puts can be left outstanding
+    bool DeferPuts;
+    // Whether statement Index of S is a relaxed shared store whose
+    // value is overwritten later in the same run of statements,
+    // before anything could read it or complete the put.
+    bool isDeadSharedStore(CompoundStmt *S, unsigned Index) {
+      BinaryOperator *Store = dyn_cast<BinaryOperator>(S->body_begin()[Index]);
+      if(Store)
+	Store = dyn_cast<BinaryOperator>(Store->IgnoreParens());
+      if(!Store || Store->getOpcode() != BO_Assign)
+	return false;
+      Expr *LHS = Store->getLHS();
+      QualType Ty = LHS->getType();
+      if(!Ty.getQualifiers().hasShared() || Ty.getQualifiers().hasStrict() ||
+	 Ty.isVolatileQualified() || LHS->HasSideEffects(SemaRef.Context))
+	return false;
+      CheckForUnstableRefs Refs(FunctionAddressTaken);
+      Refs.TraverseStmt(LHS);
+      if(Refs.Found)
+	return false;
+      // Globals and statics in the address may be written through
+      // pointers taken elsewhere
+      bool GlobalRefs = false;
+      for(std::set<Decl*>::iterator iter = Refs.Vars.begin(), end = Refs.Vars.end(); iter != end; ++iter) {
+	if(cast<VarDecl>(*iter)->hasGlobalStorage())
+	  GlobalRefs = true;
+      }
+      llvm::FoldingSetNodeID Key;
+      LHS->IgnoreParens()->Profile(Key, SemaRef.Context, true);
+      bool Literal;
+      std::set<VarDecl*> Roots;
+      VarDecl *Root = GetAccessRoot(SemaRef.Context, LHS, Literal);
+      if(Root)
+	Roots.insert(Root);
+      for(unsigned i = Index + 1; i < S->size(); ++i) {
+	Stmt *Next = S->body_begin()[i];
+	if(!(isa<Expr>(Next) || isa<DeclStmt>(Next)) || Next == StmtExprResult)
+	  return false;
+	Stmt *Reads = Next;
+	BinaryOperator *NextStore = dyn_cast<BinaryOperator>(Next);
+	if(NextStore)
+	  NextStore = dyn_cast<BinaryOperator>(NextStore->IgnoreParens());
+	bool Overwrites = false;
+	if(NextStore && NextStore->getOpcode() == BO_Assign) {
+	  llvm::FoldingSetNodeID NextKey;
+	  NextStore->getLHS()->IgnoreParens()->Profile(NextKey, SemaRef.Context, true);
+	  if(NextKey == Key) {
+	    Overwrites = true;
+	    Reads = NextStore->getRHS();
+	  }
+	}
+	SharedAccessSummary Summary(SemaRef.Context);
+	Summary.TraverseStmt(Reads);
+	if(Summary.HasCall || Summary.HasStrict || Summary.HasStmtExpr ||
+	   Summary.MayAccess(Roots, !Root, true) ||
+	   (GlobalRefs && Summary.HasPointerStore()))
+	  return false;
+	CheckForModifiedDecls Modified;
+	Modified.TraverseStmt(Reads);
+	for(std::set<Decl*>::iterator iter = Refs.Vars.begin(), end = Refs.Vars.end(); iter != end; ++iter) {
+	  if(Modified.Modified.count(*iter))
+	    return false;
+	}
+	if(Overwrites)
+	  return true;
+      }
+      return false;
+    }
+    // Whether a load should be split into a non-blocking get
+    // and a sync.  The address must not depend on other loads,
+    // which may not have completed when the get is started.
+    bool UseSplitLoad(const RedundantLoadFinder::LoadGroup& G) {
+      if(!Options.NonBlockingGets || FindPromoted(G.First->getSubExpr()))
+	return false;
+      CheckForSharedLoad Check;
+      Check.TraverseStmt(G.First->getSubExpr());
+      return !Check.Found;
+    }
+    // Shared loads in the original AST that are replaced by
+    // a temporary holding the value of an earlier load
+    std::map<Expr*, VarDecl*> ReusedLoads;
+    // Shared loads in the original AST that are replaced by
+    // part of a buffer filled by a single get
+    struct StagedAccess {
+      VarDecl *Buffer;
+      int64_t Element;  // For elements of an array
+      MemberExpr *Field;  // For fields of a struct
+    };
+    std::map<Expr*, StagedAccess> StagedLoads;
+    // Neighboring elements of a shared array, or fields of the
+    // same shared struct, that are accessed with a single transfer.
+    // Members are load groups for gets and statement indices for puts.
+    struct SharedCluster {
+      std::vector<std::size_t> Members;
+      std::vector<Expr*> Accesses;
+      std::vector<int64_t> Offsets;  // In elements or bytes
+      std::vector<int64_t> Sizes;
+      bool IsField;
+      Expr *Base;  // The struct for fields
+      Expr *Lowest;  // The element with the smallest offset
+      int64_t Min;
+      int64_t Span;
+      unsigned Index;  // Where the transfer goes
+      VarDecl *Buffer;
+    };
+    // Limits on the number of elements and bytes in a cluster
+    static const int64_t MaxClusterElements = 32;
+    static const int64_t MaxClusterBytes = 512;
+    bool isSameExpr(Expr *A, Expr *B) {
+      if(!A || !B)
+	return A == B;
+      llvm::FoldingSetNodeID AID, BID;
+      A->Profile(AID, SemaRef.Context, true);
+      B->Profile(BID, SemaRef.Context, true);
+      return AID == BID;
+    }
+    // Decomposes an element of a shared array into
+    // Base[Var + Offset], where Var may be missing.
+    bool DecomposeSharedElement(Expr *E, Expr *&Base, Expr *&Var, int64_t &Offset) {
+      ArraySubscriptExpr *AE = dyn_cast<ArraySubscriptExpr>(E->IgnoreParens());
+      if(!AE || !isPointerToShared(AE->getBase()->getType()) || AE->HasSideEffects(SemaRef.Context))
+	return false;
+      QualType PointeeType = AE->getBase()->getType()->getAs<PointerType>()->getPointeeType();
+      if(PointeeType->isArrayType() || PointeeType->isIncompleteType() ||
+	 PointeeType.getQualifiers().hasStrict() || PointeeType.isVolatileQualified())
+	return false;
+      CheckForSharedLoad IndexLoads;
+      IndexLoads.TraverseStmt(AE->getIdx());
+      if(IndexLoads.Found)
+	return false;
+      Base = AE->getBase();
+      Expr *Idx = AE->getIdx()->IgnoreParenImpCasts();
+      Var = Idx;
+      Offset = 0;
+      if(IntegerLiteral *Lit = dyn_cast<IntegerLiteral>(Idx)) {
+	Var = NULL;
+	Offset = Lit->getValue().getSExtValue();
+      } else if(BinaryOperator *BO = dyn_cast<BinaryOperator>(Idx)) {
+	IntegerLiteral *L = dyn_cast<IntegerLiteral>(BO->getLHS()->IgnoreParenImpCasts());
+	IntegerLiteral *R = dyn_cast<IntegerLiteral>(BO->getRHS()->IgnoreParenImpCasts());
+	if(BO->getOpcode() == BO_Add && R) {
+	  Var = BO->getLHS()->IgnoreParenImpCasts();
+	  Offset = R->getValue().getSExtValue();
+	} else if(BO->getOpcode() == BO_Add && L) {
+	  Var = BO->getRHS()->IgnoreParenImpCasts();
+	  Offset = L->getValue().getSExtValue();
+	} else if(BO->getOpcode() == BO_Sub && R) {
+	  Var = BO->getLHS()->IgnoreParenImpCasts();
+	  Offset = -R->getValue().getSExtValue();
+	}
+      }
+      return true;
+    }
+    // Decomposes a field of a shared struct into the struct, which
+    // is either a pointer to it or a shared lvalue, and the byte
+    // offset and size of the field.
+    bool DecomposeSharedField(Expr *E, Expr *&Base, int64_t &Offset, int64_t &Size) {
+      MemberExpr *ME = dyn_cast<MemberExpr>(E->IgnoreParens());
+      if(!ME || !E->getType().getQualifiers().hasShared() ||
+	 E->getType()->isArrayType() || E->getType()->isIncompleteType())
+	return false;
+      Size = SemaRef.Context.getTypeSizeInChars(E->getType()).getQuantity();
+      Offset = 0;
+      for(;;) {
+	FieldDecl *FD = dyn_cast<FieldDecl>(ME->getMemberDecl());
+	if(!FD || FD->isBitField())
+	  return false;
+	Offset += SemaRef.Context.toCharUnitsFromBits(SemaRef.Context.getFieldOffset(FD)).getQuantity();
+	Base = ME->getBase();
+	if(ME->isArrow())
+	  break;
+	ME = dyn_cast<MemberExpr>(Base->IgnoreParens());
+	if(!ME)
+	  break;
+      }
+      QualType StructType = Base->getType();
+      if(const PointerType *PT = StructType->getAs<PointerType>())
+	StructType = PT->getPointeeType();
+      if(!StructType.getQualifiers().hasShared() || StructType.getQualifiers().hasStrict() ||
+	 StructType.isVolatileQualified() || Base->HasSideEffects(SemaRef.Context))
+	return false;
+      CheckForSharedLoad BaseLoads;
+      BaseLoads.TraverseStmt(Base);
+      return !BaseLoads.Found;
+    }
+    bool DecomposeSharedAccess(Expr *E, SharedCluster& C, Expr *&Var, int64_t &Offset, int64_t &Size) {
+      C.IsField = DecomposeSharedField(E, C.Base, Offset, Size);
+      Var = NULL;
+      if(!C.IsField) {
+	Size = 1;
+	return DecomposeSharedElement(E, C.Base, Var, Offset);
+      }
+      return true;
+    }
+    QualType GetClusterType(const SharedCluster& C) {
+      if(!C.IsField)
+	return C.Lowest->getType();
+      QualType StructType = C.Base->getType();
+      if(const PointerType *PT = StructType->getAs<PointerType>())
+	StructType = PT->getPointeeType();
+      return StructType;
+    }
+    // Checks that the accesses fit in one transfer without reading
+    // anything that is not in the same block, and fills in the range.
+    bool CheckSharedCluster(SharedCluster& C) {
+      if(C.Members.size() < 2)
+	return false;
+      C.Min = *std::min_element(C.Offsets.begin(), C.Offsets.end());
+      C.Span = 0;
+      for(std::size_t i = 0; i < C.Offsets.size(); ++i) {
+	C.Span = std::max(C.Span, C.Offsets[i] + C.Sizes[i] - C.Min);
+	if(C.Offsets[i] == C.Min)
+	  C.Lowest = C.Accesses[i];
+      }
+      // A struct is never split between threads
+      if(C.IsField)
+	return C.Span <= MaxClusterBytes;
+      std::set<int64_t> Distinct(C.Offsets.begin(), C.Offsets.end());
+      QualType ElemTy = C.Lowest->getType();
+      if(Distinct.size() != C.Offsets.size() || C.Span > MaxClusterElements ||
+	 C.Span * SemaRef.Context.getTypeSizeInChars(ElemTy).getQuantity() > MaxClusterBytes)
+	return false;
+      uint32_t BlockSize = ElemTy.getQualifiers().getLayoutQualifier();
+      return BlockSize == 0 || (!isPhaseless(ElemTy) && C.Span <= BlockSize);
+    }
+    // Checks that a put of the range of a cluster of stores
+    // only writes data that the stores write.
+    bool CoversSharedCluster(const SharedCluster& C) {
+      if(!C.IsField)
+	return C.Span == static_cast<int64_t>(C.Offsets.size());
+      std::vector<std::pair<int64_t, int64_t> > Fields;
+      CollectFields(GetClusterType(C)->getAs<RecordType>()->getDecl(), 0, Fields);
+      for(std::size_t i = 0; i < Fields.size(); ++i) {
+	int64_t Begin = Fields[i].first, End = Fields[i].first + Fields[i].second;
+	if(End <= C.Min || Begin >= C.Min + C.Span)
+	  continue;
+	bool Written = false;
+	for(std::size_t j = 0; j < C.Offsets.size(); ++j) {
+	  if(C.Offsets[j] <= Begin && End <= C.Offsets[j] + C.Sizes[j])
+	    Written = true;
+	}
+	if(!Written)
+	  return false;
+      }
+      return true;
+    }
+    // Lists the byte ranges of the scalars in a struct
+    void CollectFields(RecordDecl *RD, int64_t Offset, std::vector<std::pair<int64_t, int64_t> >& Fields) {
+      for(RecordDecl::field_iterator iter = RD->field_begin(), end = RD->field_end(); iter != end; ++iter) {
+	int64_t FieldOffset = Offset + SemaRef.Context.toCharUnitsFromBits(SemaRef.Context.getFieldOffset(*iter)).getQuantity();
+	const RecordType *RT = iter->getType()->getAs<RecordType>();
+	if(RT && !RT->getDecl()->isUnion()) {
+	  CollectFields(RT->getDecl(), FieldOffset, Fields);
+	} else if(!iter->getType()->isIncompleteType()) {
+	  // Bit-fields are treated as a whole byte
+	  int64_t Size = iter->isBitField()? 1 : SemaRef.Context.getTypeSizeInChars(iter->getType()).getQuantity();
+	  Fields.push_back(std::make_pair(FieldOffset, Size));
+	}
+      }
+    }
+    // Finds loads of neighboring elements of the same shared array,
+    // or of fields of the same shared struct, that can all be fetched
+    // in front of the earliest statement where every one of them
+    // could be started.
+    void FindLoadClusters(const RedundantLoadFinder& Loads, std::vector<SharedCluster>& Clusters, std::vector<int>& InCluster) {
+      const std::vector<RedundantLoadFinder::LoadGroup>& Groups = Loads.Groups;
+      std::vector<bool> Seen(Groups.size());
+      for(std::size_t i = 0; i < Groups.size(); ++i) {
+	SharedCluster C;
+	Expr *Var;
+	int64_t Offset, Size;
+	if(Seen[i] || FindPromoted(Groups[i].First->getSubExpr()) ||
+	   !DecomposeSharedAccess(Groups[i].First->getSubExpr(), C, Var, Offset, Size))
+	  continue;
+	std::vector<std::size_t> Part(1, i);
+	std::vector<std::pair<int64_t, int64_t> > Ranges(1, std::make_pair(Offset, Size));
+	unsigned IssueAt = Groups[i].IssueIndex;
+	for(std::size_t j = i + 1; j < Groups.size(); ++j) {
+	  SharedCluster Other;
+	  Expr *OtherVar;
+	  if(Seen[j] || FindPromoted(Groups[j].First->getSubExpr()) ||
+	     !DecomposeSharedAccess(Groups[j].First->getSubExpr(), Other, OtherVar, Offset, Size) ||
+	     Other.IsField != C.IsField || !isSameExpr(C.Base, Other.Base) || !isSameExpr(Var, OtherVar))
+	    continue;
+	  Seen[j] = true;
+	  Part.push_back(j);
+	  Ranges.push_back(std::make_pair(Offset, Size));
+	  IssueAt = std::max(IssueAt, Groups[j].IssueIndex);
+	}
+	C.Index = IssueAt;
+	C.Buffer = NULL;
+	for(std::size_t k = 0; k < Part.size(); ++k) {
+	  if(Groups[Part[k]].StmtIndex >= IssueAt) {
+	    C.Members.push_back(Part[k]);
+	    C.Accesses.push_back(Groups[Part[k]].First->getSubExpr());
+	    C.Offsets.push_back(Ranges[k].first);
+	    C.Sizes.push_back(Ranges[k].second);
+	  }
+	}
+	if(!CheckSharedCluster(C))
+	  continue;
+	for(std::size_t k = 0; k < C.Members.size(); ++k)
+	  InCluster[C.Members[k]] = Clusters.size();
+	Clusters.push_back(C);
+      }
+    }
+    // Finds consecutive statements starting at Index that store to
+    // neighboring elements of the same shared array, or fields of
+    // the same shared struct, covering a contiguous range.  The right
+    // hand sides after the first may not read the array, since the
+    // stores are delayed to the end.
+    bool FindStoreCluster(CompoundStmt *S, unsigned Index, SharedCluster& C) {
+      Expr *Var = NULL;
+      std::set<VarDecl*> Roots;
+      VarDecl *Root = NULL;
+      std::set<Decl*> Vars;
+      for(unsigned i = Index; i < S->size(); ++i) {
+	Stmt *St = S->body_begin()[i];
+	BinaryOperator *Store = dyn_cast<BinaryOperator>(St);
+	if(Store)
+	  Store = dyn_cast<BinaryOperator>(Store->IgnoreParens());
+	SharedCluster This;
+	Expr *ThisVar;
+	int64_t Offset, Size;
+	if(St == StmtExprResult || !Store || Store->getOpcode() != BO_Assign ||
+	   FindPromoted(Store->getLHS()) ||
+	   !DecomposeSharedAccess(Store->getLHS(), This, ThisVar, Offset, Size))
+	  break;
+	if(i == Index) {
+	  CheckForUnstableRefs Refs(FunctionAddressTaken);
+	  Refs.TraverseStmt(Store->getLHS());
+	  if(Refs.Found)
+	    return false;
+	  Vars.swap(Refs.Vars);
+	  C.IsField = This.IsField;
+	  C.Base = This.Base;
+	  Var = ThisVar;
+	  bool Literal;
+	  Root = GetAccessRoot(SemaRef.Context, Store->getLHS(), Literal);
+	  if(Root)
+	    Roots.insert(Root);
+	} else {
+	  if(This.IsField != C.IsField || !isSameExpr(C.Base, This.Base) || !isSameExpr(Var, ThisVar) ||
+	     (!C.IsField && std::find(C.Offsets.begin(), C.Offsets.end(), Offset) != C.Offsets.end()))
+	    break;
+	  CheckForSharedLoad Loads;
+	  Loads.TraverseStmt(Store->getRHS());
+	  SharedAccessSummary Summary(SemaRef.Context);
+	  Summary.TraverseStmt(Store->getRHS());
+	  if(Loads.Found || Summary.HasCall || Summary.HasStrict || Summary.HasStmtExpr ||
+	     Summary.MayAccess(Roots, !Root, false))
+	    break;
+	}
+	CheckForModifiedDecls Modified;
+	Modified.TraverseStmt(Store->getRHS());
+	bool Changed = false;
+	for(std::set<Decl*>::iterator iter = Vars.begin(), end = Vars.end(); iter != end; ++iter) {
+	  if(Modified.Modified.count(*iter))
+	    Changed = true;
+	}
+	if(Changed)
+	  break;
+	C.Members.push_back(i);
+	C.Accesses.push_back(Store->getLHS());
+	C.Offsets.push_back(Offset);
+	C.Sizes.push_back(Size);
+      }
+      // Every byte that is put must have been written
+      C.Index = Index;
+      C.Buffer = NULL;
+      for(; C.Members.size() >= 2; C.Members.pop_back(), C.Accesses.pop_back(),
+	    C.Offsets.pop_back(), C.Sizes.pop_back()) {
+	if(CheckSharedCluster(C) && CoversSharedCluster(C)) {
+	  C.Index = C.Members.back();
+	  return true;
+	}
+      }
+      return false;
+    }
+    VarDecl *CreateClusterBuffer(const SharedCluster& C) {
+      QualType Ty = TransformType(GetClusterType(C)).getUnqualifiedType();
+      if(C.IsField)
+	return CreateTmpVar(Ty);
+      return CreateTmpVar(SemaRef.Context.getConstantArrayType(Ty, APInt(32, C.Span), ArrayType::Normal, 0));
+    }
+    StagedAccess GetStagedAccess(const SharedCluster& C, std::size_t Member) {
+      StagedAccess Result = { C.Buffer, C.Offsets[Member] - C.Min, NULL };
+      if(C.IsField)
+	Result.Field = cast<MemberExpr>(C.Accesses[Member]->IgnoreParens());
+      return Result;
+    }
+    // Builds the private copy of a staged element or field
+    Expr *BuildStagedAccess(const StagedAccess& Access) {
+      if(!Access.Field)
+	return SemaRef.CreateBuiltinArraySubscriptExpr(CreateSimpleDeclRef(Access.Buffer), SourceLocation(), CreateInteger(SemaRef.Context.IntTy, Access.Element), SourceLocation()).get();
+      return BuildStagedField(Access.Buffer, Access.Field);
+    }
+    Expr *BuildStagedField(VarDecl *Buffer, MemberExpr *E) {
+      MemberExpr *Inner = E->isArrow()? NULL : dyn_cast<MemberExpr>(E->getBase()->IgnoreParens());
+      Expr *Base = Inner? BuildStagedField(Buffer, Inner) : CreateSimpleDeclRef(Buffer);
+      ValueDecl *FD = E->getMemberDecl();
+      return MemberExpr::Create(SemaRef.Context, Base, false, SourceLocation(), NestedNameSpecifierLoc(), SourceLocation(),
+				FD, DeclAccessPair::make(FD, FD->getAccess()), DeclarationNameInfo(FD->getDeclName(), SourceLocation()),
+				NULL, TransformType(FD->getType()), VK_LValue, OK_Ordinary);
+    }
+    // Builds a single transfer between the buffer of a cluster and
+    // shared memory.  If the elements may cross a block boundary,
+    // the transfer is guarded by a check of the phase, and Fallback
+    // is used when they do.
+    Stmt *BuildClusterTransfer(const SharedCluster& C, bool IsGet, std::vector<Stmt*>& Fallback) {
+      QualType Ty = GetClusterType(C);
+      bool Phaseless = isPhaseless(Ty);
+      uint32_t BlockSize = Ty.getQualifiers().getLayoutQualifier();
+      Expr *Ptr = TransformExpr(C.IsField? C.Base : C.Lowest).get();
+      std::vector<Stmt*> Statements;
+      Expr *Guard = NULL;
+      if(!C.IsField && BlockSize != 0) {
+	VarDecl *PtrVar = CreateTmpVar(Decls->upcr_shared_ptr_t);
+	Statements.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(PtrVar), Ptr).get());
+	std::vector<Expr*> args;
+	args.push_back(CreateSimpleDeclRef(PtrVar));
+	Expr *Phase = BuildUPCRCall(Decls->upcr_phaseof_shared, args).get();
+	Guard = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_LE, Phase, CreateInteger(SemaRef.Context.getSizeType(), BlockSize - C.Span)).get();
+	Ptr = CreateSimpleDeclRef(PtrVar);
+      }
+      Expr *Offset = FoldUPCRLoadStore(Ptr, Phaseless);
+      Expr *Local = CreateSimpleDeclRef(C.Buffer);
+      int64_t Size = C.Span * SemaRef.Context.getTypeSizeInChars(C.Lowest->getType()).getQuantity();
+      if(C.IsField) {
+	// Only the bytes from the first to the last field
+	Size = C.Span;
+	Local = SemaRef.CreateBuiltinUnaryOp(SourceLocation(), UO_AddrOf, Local).get();
+	if(C.Min != 0) {
+	  TypeSourceInfo *CharPtr = SemaRef.Context.getTrivialTypeSourceInfo(SemaRef.Context.getPointerType(SemaRef.Context.CharTy));
+	  Local = SemaRef.BuildCStyleCastExpr(SourceLocation(), CharPtr, SourceLocation(), Local).get();
+	  Local = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Add, Local, CreateInteger(SemaRef.Context.getSizeType(), C.Min)).get();
+	  Offset = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Add, Offset, CreateInteger(SemaRef.Context.getSizeType(), C.Min)).get();
+	}
+      }
+      std::vector<Expr*> args;
+      Expr *Transfer;
+      if(IsGet) {
+	args.push_back(Local);
+	args.push_back(Ptr);
+	args.push_back(Offset);
+	args.push_back(CreateInteger(SemaRef.Context.getSizeType(), Size));
+	Transfer = BuildUPCRCall(Decls->UPCR_GET(Phaseless), args).get();
+      } else {
+	args.push_back(Ptr);
+	args.push_back(Offset);
+	args.push_back(Local);
+	args.push_back(CreateInteger(SemaRef.Context.getSizeType(), Size));
+	Transfer = BuildUPCRCall(Decls->UPCR_PUT(Phaseless), args).get();
+      }
+      if(!Guard)
+	return Transfer;
+      Sema::CompoundScopeRAII BodyScope(SemaRef);
+      StmtResult Else;
+      {
+	Sema::CompoundScopeRAII ElseScope(SemaRef);
+	Else = SemaRef.ActOnCompoundStmt(SourceLocation(), SourceLocation(), Fallback, false);
+      }
+      Sema::ConditionResult Cond = SemaRef.ActOnCondition(nullptr, SourceLocation(), Guard, Sema::ConditionKind::Boolean);
+      Statements.push_back(SemaRef.ActOnIfStmt(SourceLocation(), false, nullptr, Cond, Transfer, SourceLocation(), Else.get()).get());
+      return SemaRef.ActOnCompoundStmt(SourceLocation(), SourceLocation(), Statements, false).get();
+    }
+    // Fetches the members of a cluster of loads into a buffer
+    Stmt *BuildLoadCluster(SharedCluster& C, const RedundantLoadFinder& Loads) {
+      C.Buffer = CreateClusterBuffer(C);
+      std::vector<Stmt*> Fallback;
+      for(std::size_t i = 0; i < C.Members.size(); ++i) {
+	const RedundantLoadFinder::LoadGroup& G = Loads.Groups[C.Members[i]];
+	StagedAccess Access = GetStagedAccess(C, i);
+	QualType Ty = C.Accesses[i]->getType();
+	if(!C.IsField && Ty.getQualifiers().getLayoutQualifier() != 0)
+	  Fallback.push_back(BuildUPCRLoad(TransformExpr(C.Accesses[i]).get(), Ty, BuildStagedAccess(Access)));
+	StagedLoads[G.First] = Access;
+	for(std::size_t j = 0; j < G.Uses.size(); ++j)
+	  StagedLoads[G.Uses[j]] = Access;
+      }
+      return BuildClusterTransfer(C, true, Fallback);
+    }
+    // Writes the members of a cluster of stores from its buffer
+    Stmt *BuildStoreCluster(SharedCluster& C) {
+      std::vector<Stmt*> Fallback;
+      for(std::size_t i = 0; i < C.Members.size(); ++i) {
+	QualType Ty = C.Accesses[i]->getType();
+	if(!C.IsField && Ty.getQualifiers().getLayoutQualifier() != 0)
+	  Fallback.push_back(BuildUPCRStore(TransformExpr(C.Accesses[i]).get(), BuildStagedAccess(GetStagedAccess(C, i)), Ty, false).get());
+      }
+      return BuildClusterTransfer(C, false, Fallback);
+    }
+    // Expressions in the original AST whose value is discarded
+    std::set<Expr*> UnusedResults;
+    // The last statement of a statement expression is its value
+    Stmt *StmtExprResult;
+    void MarkResultUnused(Expr *E) {
+      E = E->IgnoreParens();
+      UnusedResults.insert(E);
+      if(BinaryOperator *BO = dyn_cast<BinaryOperator>(E)) {
+	if(BO->getOpcode() == BO_Comma) {
+	  MarkResultUnused(BO->getLHS());
+	  MarkResultUnused(BO->getRHS());
+	}
+      } else if(CStyleCastExpr *CE = dyn_cast<CStyleCastExpr>(E)) {
+	if(CE->getCastKind() == CK_ToVoid)
+	  MarkResultUnused(CE->getSubExpr());
+      }
+    }
+    bool isResultUnused(Expr *E) {
+      return UnusedResults.find(E) != UnusedResults.end();
+    }
+    StmtResult TransformStmt(Stmt *S) {
+      if(Expr *E = dyn_cast_or_null<Expr>(S)) {
+	if(S != StmtExprResult)
+	  MarkResultUnused(E);
+      }
+      return TreeTransformUPC::TransformStmt(S);
+    }
+    // x = y as a statement, where both are relaxed shared objects of
+    // the same type.  The value doesn't need to pass through a
+    // private temporary unless the load of y is already replaced.
+    // upcr_memcpy is undefined for overlapping objects, so x and y
+    // must be parts of different variables.
+    bool isSharedCopy(BinaryOperator *E) {
+      ImplicitCastExpr *Load = dyn_cast<ImplicitCastExpr>(E->getRHS()->IgnoreParens());
+      if(!isResultUnused(E) || !Load || Load->getCastKind() != CK_LValueToRValue)
+	return false;
+      QualType DstTy = E->getLHS()->getType();
+      QualType SrcTy = Load->getSubExpr()->getType();
+      if(!SrcTy.getQualifiers().hasShared() ||
+	 DstTy.getQualifiers().hasStrict() || SrcTy.getQualifiers().hasStrict() ||
+	 DstTy.isVolatileQualified() || SrcTy.isVolatileQualified() ||
+	 !SemaRef.Context.hasSameUnqualifiedType(DstTy, SrcTy))
+	return false;
+      if(GatheredLoads.count(Load) || HaloReads.count(Load) || ReusedLoads.count(Load) ||
+	 StagedLoads.count(Load) || FindPromoted(Load->getSubExpr()))
+	return false;
+      bool Literal;
+      VarDecl *DstRoot = GetAccessRoot(SemaRef.Context, E->getLHS(), Literal);
+      VarDecl *SrcRoot = GetAccessRoot(SemaRef.Context, Load->getSubExpr(), Literal);
+      if(!DstRoot || !SrcRoot || DstRoot->getCanonicalDecl() == SrcRoot->getCanonicalDecl())
+	return false;
+      // A deferred put of a value is cheaper than a blocking copy
+      return !DeferPuts || !typeFitsUPCRValuePutGet(TransformType(DstTy).getUnqualifiedType());
+    }
+    Expr *BuildUPCRSharedCopy(Expr *Dst, Expr *Src) {
+      std::vector<Expr*> args;
+      Expr *DstPtr = TransformExpr(Dst).get();
+      Expr *SrcPtr = TransformExpr(Src).get();
+      args.push_back(isPhaseless(Dst->getType())? BuildUPCRPsharedToShared(DstPtr).get() : DstPtr);
+      args.push_back(isPhaseless(Src->getType())? BuildUPCRPsharedToShared(SrcPtr).get() : SrcPtr);
+      args.push_back(CreateInteger(SemaRef.Context.getSizeType(), SemaRef.Context.getTypeSizeInChars(Dst->getType()).getQuantity()));
+      return BuildUPCRCall(Decls->upcr_memcpy, args).get();
+    }
     ExprResult TransformBinaryOperator(BinaryOperator *E) {
+      if(E->getOpcode() == BO_Comma) {
+	MarkResultUnused(E->getLHS());
+      }
       // Catch assignment to shared variables
       if(E->getOpcode() == BO_Assign && E->getLHS()->getType().getQualifiers().hasShared()) {
+	if(PromotedScalar *P = FindPromoted(E->getLHS())) {
+	  Expr *RHS = TransformExpr(E->getRHS()).get();
+	  return BuildPromotedStore(*P, SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(P->Value), RHS).get());
+	}
+	if(isSharedCopy(E))
+	  return BuildUPCRSharedCopy(E->getLHS(), cast<ImplicitCastExpr>(E->getRHS()->IgnoreParens())->getSubExpr());
 	Expr *LHS = TransformExpr(E->getLHS()).get();
 	Expr *RHS = TransformExpr(E->getRHS()).get();
 	return BuildUPCRStore(LHS, RHS, E->getLHS()->getType());
@@ -1255,12 +3367,68 @@ namespace {
       // Otherwise use the default transform
       return TreeTransformUPC::TransformBinaryOperator(E);
     }
+    // Whether the update E of the shared lvalue LHS can be done by a
+    // single remote fetch-op instead of a get followed by a put.
+    // Atomics are only coherent with ordinary accesses on some
+    // conduits, so this is opt-in.
+    bool isAtomicUpdate(Expr *E, Expr *LHS, BinaryOperatorKind Opc, Expr *RHS) {
+      if(!isResultUnused(E) || (RHS && !RHS->getType()->isIntegerType()))
+	return false;
+      return isAtomicUpdateType(LHS->getType(), Opc);
+    }
+    bool isAtomicUpdateType(QualType Ty, BinaryOperatorKind Opc) {
+      if(!Options.AtomicUpdates)
+	return false;
+      if(Ty.getQualifiers().hasStrict() || Ty.isVolatileQualified())
+	return false;
+      if(!Ty->isIntegerType() || Ty->isBooleanType() || Ty->isEnumeralType())
+	return false;
+      uint64_t Size = SemaRef.Context.getTypeSize(Ty);
+      if(Size != 32 && Size != 64)
+	return false;
+      return Opc == BO_Add || Opc == BO_Sub || Opc == BO_And || Opc == BO_Or || Opc == BO_Xor;
+    }
+    Expr *BuildUPCRAtomicUpdate(Expr *Ptr, QualType Ty, BinaryOperatorKind Opc, Expr *Val) {
+      if(isPhaseless(Ty))
+	Ptr = BuildUPCRPsharedToShared(Ptr).get();
+      int Op;
+      switch(Opc) {
+      case BO_Sub:
+      case BO_Add: Op = UPCRDecls::ATOMIC_ADD; break;
+      case BO_And: Op = UPCRDecls::ATOMIC_AND; break;
+      case BO_Or: Op = UPCRDecls::ATOMIC_OR; break;
+      default: Op = UPCRDecls::ATOMIC_XOR; break;
+      }
+      int Index = (SemaRef.Context.getTypeSize(Ty) == 64? 2 : 0) + (Ty->isUnsignedIntegerType()? 1 : 0);
+      if(Opc == BO_Sub) {
+	// x -= v is x += -v, negated after conversion to the width of x.
+	// Negating an unsigned value avoids overflow on the minimum.
+	QualType OpTy = Decls->bupc_atomic_fetch[Index][Op]->getParamDecl(1)->getType();
+	QualType NegTy = SemaRef.Context.getCorrespondingUnsignedType(OpTy.getCanonicalType());
+	Val = SemaRef.BuildCStyleCastExpr(SourceLocation(), SemaRef.Context.getTrivialTypeSourceInfo(NegTy), SourceLocation(), BuildParens(Val).get()).get();
+	Val = SemaRef.CreateBuiltinUnaryOp(SourceLocation(), UO_Minus, Val).get();
+	Val = SemaRef.BuildCStyleCastExpr(SourceLocation(), SemaRef.Context.getTrivialTypeSourceInfo(OpTy), SourceLocation(), BuildParens(Val).get()).get();
+      }
+      std::vector<Expr*> args;
+      args.push_back(Ptr);
+      args.push_back(Val);
+      return BuildUPCRCall(Decls->bupc_atomic_fetch[Index][Op], args).get();
+    }
     ExprResult TransformCompoundAssignOperator(CompoundAssignOperator *E) {
-      if(E->getLHS()->getType().getQualifiers().hasShared()) {
+      if(PromotedScalar *P = FindPromoted(E->getLHS())) {
+	Expr *RHS = TransformExpr(E->getRHS()).get();
+	return BuildPromotedStore(*P, SemaRef.CreateBuiltinBinOp(SourceLocation(), E->getOpcode(), CreateSimpleDeclRef(P->Value), RHS).get());
+      } else if(E->getLHS()->getType().getQualifiers().hasShared() &&
+		isAtomicUpdate(E, E->getLHS(), BinaryOperator::getOpForCompoundAssignment(E->getOpcode()), E->getRHS())) {
+	// x += v as a statement
+	Expr *Ptr = TransformExpr(E->getLHS()).get();
+	Expr *RHS = TransformExpr(E->getRHS()).get();
+	return BuildUPCRAtomicUpdate(Ptr, E->getLHS()->getType(), BinaryOperator::getOpForCompoundAssignment(E->getOpcode()), RHS);
+      } else if(E->getLHS()->getType().getQualifiers().hasShared()) {
 	QualType Ty = E->getLHS()->getType();
 	bool Phaseless = isPhaseless(Ty);
 	QualType PtrType = Phaseless? Decls->upcr_pshared_ptr_t : Decls->upcr_shared_ptr_t;
-	VarDecl * TmpPtrDecl = CreateTmpVar(PtrType);
+	VarDecl * TmpPtrDecl = CreateTmpVar(PtrType, true);
 	BinaryOperatorKind Opc = BinaryOperator::getOpForCompoundAssignment(E->getOpcode());
 	Expr * TmpPtr = SemaRef.BuildDeclRefExpr(TmpPtrDecl, PtrType, VK_LValue, SourceLocation()).get();
 	Expr * SaveLHS = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, TmpPtr, BuildParens(TransformExpr(E->getLHS()).get()).get()).get();
@@ -1269,11 +3437,18 @@ namespace {
 	Expr * OpResult = CreateArithmeticExpr(LHSVal, RHS, Ty, Opc).get();
 	Expr * Result = BuildUPCRStore(TmpPtr, OpResult, Ty).get();
 	return BuildParens(BuildComma(SaveLHS, Result).get());
+      }	else if(isPointerToShared(E->getLHS()->getType()) && isResultUnused(E)) {
+	// p += k as a statement
+	Expr *IntVal = TransformExpr(E->getRHS()).get();
+	if(E->getOpcode() == BO_SubAssign) {
+	  IntVal = SemaRef.CreateBuiltinUnaryOp(SourceLocation(), UO_Minus, BuildParens(IntVal).get()).get();
+	}
+	return CreateUPCPointerIncrement(TransformExpr(E->getLHS()).get(), IntVal, E->getLHS()->getType());
       }	else if(isPointerToShared(E->getLHS()->getType())) {
 	QualType Ty = E->getLHS()->getType();
 	BinaryOperatorKind Opc = BinaryOperator::getOpForCompoundAssignment(E->getOpcode());
 	QualType PtrType = SemaRef.Context.getPointerType(TransformType(Ty));
-	VarDecl * TmpPtrDecl = CreateTmpVar(PtrType);
+	VarDecl * TmpPtrDecl = CreateTmpVar(PtrType, true);
 	Expr * TmpPtr = CreateSimpleDeclRef(TmpPtrDecl);
 	Expr * LHSPtr = SemaRef.CreateBuiltinUnaryOp(SourceLocation(), UO_AddrOf, BuildParens(TransformExpr(E->getLHS()).get()).get()).get();
 	Expr * SetPtr = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, TmpPtr,
@@ -1293,21 +3468,45 @@ namespace {
 	QualType PointeeType = LHS->getType()->getAs<PointerType>()->getPointeeType();
 	ArrayDimensionT Dims = GetArrayDimension(PointeeType);
 	int64_t ElementSize = Dims.ElementSize;
-	Expr *Ptr = TransformExpr(LHS).get();
 	Expr *IntVal = TransformExpr(RHS).get();
 	IntVal = MaybeAdjustForArray(Dims, IntVal, BO_Mul).get();
-	uint32_t LayoutQualifier = PointeeType.getQualifiers().getLayoutQualifier();
-	if(LayoutQualifier == 0) {
-	  return BuildUPCRAddPsharedI(Ptr, ElementSize, IntVal);
-	} else if(LayoutQualifier == 1) {
-	  return BuildUPCRAddPshared1(Ptr, ElementSize, IntVal);
-	} else {
-	  return BuildUPCRAddShared(Ptr, ElementSize, IntVal, LayoutQualifier);
+	// a[i][j][k] is linearized into a single offset from a,
+	// since the indices all count elements of the same type.
+	while(ArraySubscriptExpr *Inner = GetSharedSubarray(LHS)) {
+	  LHS = Inner->getBase();
+	  PointeeType = LHS->getType()->getAs<PointerType>()->getPointeeType();
+	  Expr *InnerVal = TransformExpr(Inner->getIdx()).get();
+	  InnerVal = MaybeAdjustForArray(GetArrayDimension(PointeeType), InnerVal, BO_Mul).get();
+	  IntVal = BuildIncrementSum(InnerVal, IntVal);
 	}
+	Expr *Ptr = MaybeHoistLoopInvariant(LHS, TransformExpr(LHS).get());
+	ExprResult Result = BuildSharedPointerAdd(Ptr, PointeeType, ElementSize, IntVal);
+	return MaybeHoistLoopInvariant(E, Result.get());
       } else {
 	return TreeTransformUPC::TransformArraySubscriptExpr(E);
       }
     }
+    // Returns a[i] if E is the decay of a[i] to a pointer,
+    // where a is a shared multi-dimensional array.
+    ArraySubscriptExpr *GetSharedSubarray(Expr *E) {
+      ImplicitCastExpr *Decay = dyn_cast<ImplicitCastExpr>(E->IgnoreParens());
+      if(!Decay || Decay->getCastKind() != CK_ArrayToPointerDecay)
+	return NULL;
+      ArraySubscriptExpr *Inner = dyn_cast<ArraySubscriptExpr>(Decay->getSubExpr()->IgnoreParens());
+      if(!Inner || !isPointerToShared(Inner->getBase()->getType()))
+	return NULL;
+      return Inner;
+    }
+    ExprResult BuildSharedPointerAdd(Expr *Ptr, QualType PointeeType, int64_t ElementSize, Expr *IntVal) {
+      uint32_t LayoutQualifier = PointeeType.getQualifiers().getLayoutQualifier();
+      if(LayoutQualifier == 0) {
+	return BuildUPCRAddPsharedI(Ptr, ElementSize, IntVal);
+      } else if(LayoutQualifier == 1) {
+	return BuildUPCRAddPshared1(Ptr, ElementSize, IntVal);
+      } else {
+	return BuildUPCRAddShared(Ptr, ElementSize, IntVal, LayoutQualifier);
+      }
+    }
     ExprResult TransformMemberExpr(MemberExpr *E) {
       Expr *Base = E->getBase();
       QualType BaseType = Base->getType();
@@ -1320,6 +3519,7 @@ namespace {
 	if(!isPhaseless(BaseType)) {
 	  NewBase = BuildUPCRSharedToPshared(NewBase).get();
 	}
+	NewBase = MaybeHoistLoopInvariant(Base, NewBase);
 	CharUnits Offset = SemaRef.Context.toCharUnitsFromBits(SemaRef.Context.getFieldOffset(FD));
 	Expr *IntVal = CreateInteger(SemaRef.Context.getSizeType(), Offset.getQuantity());
 	return BuildUPCRAddPsharedI(NewBase, 1, IntVal);
@@ -1359,7 +3559,9 @@ namespace {
       std::vector<Expr*> args;
       args.push_back(DRE);
       Expr *Call = BuildUPCRCall(Decls->UPCR_TLD_ADDR, args).get();
-      return BuildParens(SemaRef.CreateBuiltinUnaryOp(SourceLocation(), UO_Deref, SemaRef.BuildCStyleCastExpr(SourceLocation(), PtrTy, SourceLocation(), Call).get()).get());
+      Expr *Addr = SemaRef.BuildCStyleCastExpr(SourceLocation(), PtrTy, SourceLocation(), Call).get();
+      Addr = CacheOnEntry(CachedTLDAddrs[DRE->getDecl()], Addr);
+      return BuildParens(SemaRef.CreateBuiltinUnaryOp(SourceLocation(), UO_Deref, Addr).get());
     }
     ExprResult TransformDeclRefExpr(DeclRefExpr *E) {
       ExprResult Result = TreeTransformUPC::TransformDeclRefExpr(E);
@@ -1372,7 +3574,911 @@ namespace {
       }
       return Result;
     }
+    // Loop invariant shared address computations are hoisted
+    // into temporaries that are set before the loop.
+    struct LoopHoistInfo {
+      std::set<Decl*> Modified;
+      bool CanHoist;
+      std::vector<Stmt*> Hoisted;
+      // Loads and write backs of promoted shared scalars
+      std::vector<Stmt*> Before;
+      std::vector<Stmt*> After;
+    };
+    // A shared scalar that is kept in a temporary during a loop.
+    // Dirty is set when the temporary is assigned, and is NULL
+    // if the loop never writes it.
+    struct PromotedScalar {
+      VarDecl *Value;
+      VarDecl *Dirty;
+    };
+    // Maps occurrences of promoted scalars in the original AST
+    std::map<Expr*, PromotedScalar> PromotedAccesses;
+    PromotedScalar *FindPromoted(Expr *E) {
+      std::map<Expr*, PromotedScalar>::iterator pos = PromotedAccesses.find(E->IgnoreParens());
+      return pos == PromotedAccesses.end()? NULL : &pos->second;
+    }
+    Expr *BuildPromotedStore(const PromotedScalar& P, Expr *Update) {
+      Expr *SetDirty = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(P.Dirty), CreateInteger(SemaRef.Context.IntTy, 1)).get();
+      return BuildParens(BuildComma(SetDirty, Update).get()).get();
+    }
+    void PromoteSharedScalars(Stmt *S) {
+      FindPromotableShared Find(SemaRef.Context);
+      Find.TraverseStmt(S);
+      std::vector<FindPromotableShared::Candidate> Candidates;
+      Find.GetCandidates(Candidates);
+      // Updates in the body of a upc_forall are reductions
+      FindReductionUpdates Updates(SemaRef.Context);
+      UPCForAllStmt *ForAll = dyn_cast<UPCForAllStmt>(S);
+      if(ForAll && ForAll->getAfnty() && !Candidates.empty()) {
+	Updates.AddUpdate(ForAll->getBody());
+	Updates.TraverseStmt(ForAll->getBody());
+      }
+      for(std::size_t i = 0; i < Candidates.size(); ++i) {
+	FindPromotableShared::Candidate& C = Candidates[i];
+	// Already promoted in an enclosing loop
+	if(FindPromoted(C.LValues.front()))
+	  continue;
+	Expr *LValue = C.LValues.front();
+	QualType Ty = LValue->getType();
+	PromotedScalar P;
+	P.Value = CreateTmpVar(TransformType(Ty).getUnqualifiedType());
+	P.Dirty = NULL;
+	FindReductionUpdates::Kind Reduction = ForAll? Updates.GetKind(C.LValues) : FindReductionUpdates::RK_None;
+	bool Atomic = isAtomicUpdateType(Ty, GetReductionOpcode(Reduction));
+	// Without an atomic, the partial results are combined between
+	// barriers, which every thread must reach.
+	if(!Atomic && !CanCombineAfterForAll())
+	  Reduction = FindReductionUpdates::RK_None;
+	if(Reduction != FindReductionUpdates::RK_None) {
+	  // Each thread accumulates its iterations privately, and
+	  // folds them into x once after the loop.
+	  P.Dirty = CreateTmpVar(SemaRef.Context.IntTy);
+	  LoopStack.back().Before.push_back(BuildReductionInit(LValue, P.Value, Reduction));
+	  LoopStack.back().Before.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(P.Dirty), CreateInteger(SemaRef.Context.IntTy, 0)).get());
+	  if(Atomic) {
+	    Sema::ConditionResult Cond = SemaRef.ActOnCondition(nullptr, SourceLocation(), CreateSimpleDeclRef(P.Dirty), Sema::ConditionKind::Boolean);
+	    Stmt *Merge = BuildUPCRAtomicUpdate(TransformExpr(LValue).get(), Ty, GetReductionOpcode(Reduction), CreateSimpleDeclRef(P.Value));
+	    LoopStack.back().After.push_back(SemaRef.ActOnIfStmt(SourceLocation(), false, nullptr, Cond, Merge, SourceLocation(), nullptr).get());
+	  } else {
+	    BuildReductionCombine(LValue, P.Value, Reduction, LoopStack.back().After);
+	  }
+	} else if(C.Read) {
+	  LoopStack.back().Before.push_back(BuildUPCRLoad(TransformExpr(LValue).get(), Ty, CreateSimpleDeclRef(P.Value)));
+	}
+	if(C.Written && !P.Dirty) {
+	  P.Dirty = CreateTmpVar(SemaRef.Context.IntTy);
+	  LoopStack.back().Before.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(P.Dirty), CreateInteger(SemaRef.Context.IntTy, 0)).get());
+	  Sema::ConditionResult Cond = SemaRef.ActOnCondition(nullptr, SourceLocation(), CreateSimpleDeclRef(P.Dirty), Sema::ConditionKind::Boolean);
+	  Stmt *Store = BuildUPCRStore(TransformExpr(LValue).get(), CreateSimpleDeclRef(P.Value), Ty, false).get();
+	  LoopStack.back().After.push_back(SemaRef.ActOnIfStmt(SourceLocation(), false, nullptr, Cond, Store, SourceLocation(), nullptr).get());
+	}
+	for(std::size_t j = 0; j < C.LValues.size(); ++j) {
+	  PromotedAccesses[C.LValues[j]] = P;
+	}
+      }
+    }
+    // Starts the private accumulator of a reduction at the identity
+    // of the operation.  min and max start from the current value.
+    Expr *BuildReductionInit(Expr *LValue, VarDecl *Value, FindReductionUpdates::Kind K) {
+      Expr *Identity;
+      switch(K) {
+      case FindReductionUpdates::RK_Min:
+      case FindReductionUpdates::RK_Max:
+	return BuildUPCRLoad(TransformExpr(LValue).get(), LValue->getType(), CreateSimpleDeclRef(Value));
+      case FindReductionUpdates::RK_Mul:
+	Identity = CreateInteger(SemaRef.Context.IntTy, 1);
+	break;
+      case FindReductionUpdates::RK_And:
+	Identity = SemaRef.CreateBuiltinUnaryOp(SourceLocation(), UO_Not, CreateInteger(SemaRef.Context.IntTy, 0)).get();
+	break;
+      default:
+	Identity = CreateInteger(SemaRef.Context.IntTy, 0);
+	break;
+      }
+      return SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(Value), Identity).get();
+    }
+    // BO_Comma for min and max, which have no operator
+    static BinaryOperatorKind GetReductionOpcode(FindReductionUpdates::Kind K) {
+      switch(K) {
+      case FindReductionUpdates::RK_Add: return BO_Add;
+      case FindReductionUpdates::RK_Mul: return BO_Mul;
+      case FindReductionUpdates::RK_And: return BO_And;
+      case FindReductionUpdates::RK_Or: return BO_Or;
+      case FindReductionUpdates::RK_Xor: return BO_Xor;
+      default: return BO_Comma;
+      }
+    }
+    // upc_forall is collective, so every thread reaches the end of
+    // an outermost one in a function that is never called from a
+    // forall body.  A user's split-phase barrier could be pending
+    // there, so functions with upc_notify are excluded.
+    bool CanCombineAfterForAll() {
+      return ForAllDepth == 0 && CurForAllContext == UPCCallGraph::FAC_Outside &&
+	!FunctionHasSplitBarrier;
+    }
+    // Combines the private accumulators of all threads into LValue:
+    //   buf[MYTHREAD] = value; barrier;
+    //   if(MYTHREAD == 0) { value = x; for(t...) value op= buf[t]; x = value; }
+    //   barrier;
+    // buf is a shared [1] T[THREADS] allocated at startup.
+    void BuildReductionCombine(Expr *LValue, VarDecl *Value, FindReductionUpdates::Kind K, std::vector<Stmt*>& Result) {
+      ASTContext& Context = SemaRef.Context;
+      QualType Ty = LValue->getType();
+      QualType ElemTy = TransformType(Ty).getUnqualifiedType();
+      QualType BufferTy = Context.getSharedType(ElemTy);
+      int64_t ElemSz = Context.getTypeSizeInChars(ElemTy).getQuantity();
+      VarDecl *Buffer = CreateReductionBuffer(ElemTy);
+      // The barrier must see the put complete
+      bool SavedDeferPuts = DeferPuts;
+      DeferPuts = false;
+      Expr *Mine = BuildUPCRAddPshared1(CreateSimpleDeclRef(Buffer), ElemSz, BuildUPCRMyThread()).get();
+      Result.push_back(BuildUPCRStore(Mine, CreateSimpleDeclRef(Value), BufferTy, false).get());
+      Result.push_back(BuildUPCRCall(Decls->upcr_barrier, BuildUPCBarrierArgs(NULL)).get());
+      std::vector<Stmt*> Fold;
+      Fold.push_back(BuildUPCRLoad(TransformExpr(LValue).get(), Ty, CreateSimpleDeclRef(Value)));
+      VarDecl *Thread = CreateTmpVar(Context.IntTy);
+      Expr *Partial = BuildUPCRLoad(BuildUPCRAddPshared1(CreateSimpleDeclRef(Buffer), ElemSz, CreateSimpleDeclRef(Thread)).get(), BufferTy);
+      Expr *Update;
+      if(K == FindReductionUpdates::RK_Min || K == FindReductionUpdates::RK_Max) {
+	// value = (p = buf[t]) < value? p : value
+	VarDecl *Current = CreateTmpVar(ElemTy);
+	Expr *SetCurrent = BuildParens(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(Current), Partial).get()).get();
+	Expr *Better = SemaRef.CreateBuiltinBinOp(SourceLocation(), K == FindReductionUpdates::RK_Min? BO_LT : BO_GT,
+						  SetCurrent, CreateSimpleDeclRef(Value)).get();
+	Update = SemaRef.ActOnConditionalOp(SourceLocation(), SourceLocation(), Better, CreateSimpleDeclRef(Current), CreateSimpleDeclRef(Value)).get();
+      } else {
+	Update = SemaRef.CreateBuiltinBinOp(SourceLocation(), GetReductionOpcode(K), CreateSimpleDeclRef(Value), Partial).get();
+      }
+      Stmt *Body = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(Value), Update).get();
+      {
+	Expr *Init = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(Thread), CreateInteger(Context.IntTy, 0)).get();
+	Expr *Test = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_LT, CreateSimpleDeclRef(Thread), BuildUPCRThreads()).get();
+	Sema::ConditionResult Cond = SemaRef.ActOnCondition(nullptr, SourceLocation(), Test, Sema::ConditionKind::Boolean);
+	Expr *Inc = SemaRef.CreateBuiltinUnaryOp(SourceLocation(), UO_PreInc, CreateSimpleDeclRef(Thread)).get();
+	Sema::FullExprArg FullInc(SemaRef.MakeFullExpr(Inc));
+	Fold.push_back(SemaRef.ActOnForStmt(SourceLocation(), SourceLocation(), Init, Cond, FullInc, SourceLocation(), Body).get());
+      }
+      Fold.push_back(BuildUPCRStore(TransformExpr(LValue).get(), CreateSimpleDeclRef(Value), Ty, false).get());
+      DeferPuts = SavedDeferPuts;
+      StmtResult FoldBody;
+      {
+	Sema::CompoundScopeRAII FoldScope(SemaRef);
+	FoldBody = SemaRef.ActOnCompoundStmt(SourceLocation(), SourceLocation(), Fold, false);
+      }
+      Expr *First = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_EQ, BuildUPCRMyThread(), CreateInteger(Context.IntTy, 0)).get();
+      Sema::ConditionResult Cond = SemaRef.ActOnCondition(nullptr, SourceLocation(), First, Sema::ConditionKind::Boolean);
+      Result.push_back(SemaRef.ActOnIfStmt(SourceLocation(), false, nullptr, Cond, FoldBody.get(), SourceLocation(), nullptr).get());
+      // The buffer is reused the next time the loop runs
+      Result.push_back(BuildUPCRCall(Decls->upcr_barrier, BuildUPCBarrierArgs(NULL)).get());
+    }
+    // A static upcr_pshared_ptr_t for a shared [1] T[THREADS]
+    VarDecl *CreateReductionBuffer(QualType ElemTy) {
+      TranslationUnitDecl *TU = SemaRef.Context.getTranslationUnitDecl();
+      std::string Name = (Twine("_bupc_reduce") + Twine(ReductionBuffers.size())).str();
+      VarDecl *Result = VarDecl::Create(SemaRef.Context, TU, SourceLocation(), SourceLocation(),
+					&SemaRef.Context.Idents.get(Name), Decls->upcr_pshared_ptr_t,
+					SemaRef.Context.getTrivialTypeSourceInfo(Decls->upcr_pshared_ptr_t), SC_Static);
+      ReductionBuffers.push_back(std::make_pair(Result, ElemTy));
+      LocalStatics.push_back(Result);
+      return Result;
+    }
+    std::vector<std::pair<VarDecl*, QualType> > ReductionBuffers;
+    std::vector<LoopHoistInfo> LoopStack;
+    // Variables of the current function whose address is taken.
+    // These may be modified through pointers at any time.
+    std::set<Decl*> FunctionAddressTaken;
+    bool FunctionHasSplitBarrier;
+    void EnterLoop(Stmt *S) {
+      CheckForModifiedDecls Check;
+      Check.TraverseStmt(S);
+      LoopStack.push_back(LoopHoistInfo());
+      LoopStack.back().Modified.swap(Check.Modified);
+      // A jump into the loop would bypass the hoisted code.
+      LoopStack.back().CanHoist = !Check.HasLabel;
+      if(LoopStack.back().CanHoist)
+	PromoteSharedScalars(S);
+    }
+    StmtResult ExitLoop(StmtResult Loop) {
+      std::vector<Stmt*> Statements;
+      std::vector<Stmt*> After;
+      Statements.swap(LoopStack.back().Hoisted);
+      Statements.insert(Statements.end(), LoopStack.back().Before.begin(), LoopStack.back().Before.end());
+      After.swap(LoopStack.back().After);
+      LoopStack.pop_back();
+      if(Loop.isInvalid() || (Statements.empty() && After.empty()))
+	return Loop;
+      Sema::CompoundScopeRAII BodyScope(SemaRef);
+      Statements.push_back(Loop.get());
+      Statements.insert(Statements.end(), After.begin(), After.end());
+      return SemaRef.ActOnCompoundStmt(SourceLocation(), SourceLocation(), Statements, false);
+    }
+    // Determines whether the value of an expression in the original
+    // AST is the same on every iteration of a loop, and can be
+    // evaluated speculatively in front of it.
+    bool isLoopInvariant(Expr *E, const LoopHoistInfo& Loop) {
+      E = E->IgnoreParens();
+      if(isa<IntegerLiteral>(E) || isa<CharacterLiteral>(E) ||
+	 isa<UPCThreadExpr>(E) || isa<UPCMyThreadExpr>(E)) {
+	return true;
+      } else if(UnaryExprOrTypeTraitExpr *UE = dyn_cast<UnaryExprOrTypeTraitExpr>(E)) {
+	return !UE->getTypeOfArgument()->isVariablyModifiedType();
+      } else if(CastExpr *CE = dyn_cast<CastExpr>(E)) {
+	if(CE->getCastKind() == CK_LValueToRValue) {
+	  QualType Ty = CE->getSubExpr()->getType();
+	  if(Ty.getQualifiers().hasShared() || Ty.isVolatileQualified())
+	    return false;
+	}
+	return isLoopInvariant(CE->getSubExpr(), Loop);
+      } else if(DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(E)) {
+	if(isa<EnumConstantDecl>(DRE->getDecl()))
+	  return true;
+	VarDecl *VD = dyn_cast<VarDecl>(DRE->getDecl());
+	if(!VD)
+	  return false;
+	// The handle of a shared variable never changes
+	if(VD->getType().getQualifiers().hasShared())
+	  return true;
+	if(!VD->hasLocalStorage())
+	  return VD->getType().isConstQualified();
+	return !VD->getType().isVolatileQualified() &&
+	  Loop.Modified.find(VD) == Loop.Modified.end() &&
+	  FunctionAddressTaken.find(VD) == FunctionAddressTaken.end();
+      } else if(BinaryOperator *BO = dyn_cast<BinaryOperator>(E)) {
+	if(BO->isAssignmentOp() || BO->getOpcode() == BO_Comma)
+	  return false;
+	// Don't speculate a division by zero
+	if((BO->getOpcode() == BO_Div || BO->getOpcode() == BO_Rem) &&
+	   !isa<IntegerLiteral>(BO->getRHS()->IgnoreParenImpCasts()))
+	  return false;
+	return isLoopInvariant(BO->getLHS(), Loop) && isLoopInvariant(BO->getRHS(), Loop);
+      } else if(UnaryOperator *UO = dyn_cast<UnaryOperator>(E)) {
+	switch(UO->getOpcode()) {
+	case UO_Plus: case UO_Minus: case UO_Not: case UO_LNot: case UO_AddrOf:
+	  return isLoopInvariant(UO->getSubExpr(), Loop);
+	case UO_Deref:
+	  return isPointerToShared(UO->getSubExpr()->getType()) &&
+	    isLoopInvariant(UO->getSubExpr(), Loop);
+	default:
+	  return false;
+	}
+      } else if(ArraySubscriptExpr *AE = dyn_cast<ArraySubscriptExpr>(E)) {
+	return isPointerToShared(AE->getBase()->getType()) &&
+	  isLoopInvariant(AE->getBase(), Loop) && isLoopInvariant(AE->getIdx(), Loop);
+      } else if(MemberExpr *ME = dyn_cast<MemberExpr>(E)) {
+	QualType BaseType = ME->getBase()->getType();
+	if(const PointerType *PT = BaseType->getAs<PointerType>())
+	  BaseType = PT->getPointeeType();
+	return BaseType.getQualifiers().hasShared() && isLoopInvariant(ME->getBase(), Loop);
+      } else if(ConditionalOperator *CO = dyn_cast<ConditionalOperator>(E)) {
+	return isLoopInvariant(CO->getCond(), Loop) &&
+	  isLoopInvariant(CO->getLHS(), Loop) && isLoopInvariant(CO->getRHS(), Loop);
+      }
+      return false;
+    }
+    // Indefinite offsets and phase conversions are folded into
+    // the accessors by FoldUPCRLoadStore, so hoisting them gains nothing.
+    bool isFoldableSharedAddress(Expr *E) {
+      while(CallExpr *CE = dyn_cast<CallExpr>(E->IgnoreParens())) {
+	FunctionDecl *FD = CE->getDirectCallee();
+	if(FD != Decls->UPCR_ADD_PSHAREDI && FD != Decls->UPCR_SHARED_TO_PSHARED &&
+	   FD != Decls->UPCR_PSHARED_TO_SHARED)
+	  return false;
+	E = CE->getArg(0);
+      }
+      return true;
+    }
+    // Orig is the original expression that was transformed into
+    // Result.  If it is invariant in an enclosing loop, save Result
+    // in a temporary before the outermost such loop.
+    Expr *MaybeHoistLoopInvariant(Expr *Orig, Expr *Result) {
+      if(!isa<CallExpr>(Result->IgnoreParens()) || isFoldableSharedAddress(Result))
+	return Result;
+      for(std::size_t i = 0; i < LoopStack.size(); ++i) {
+	if(LoopStack[i].CanHoist && isLoopInvariant(Orig, LoopStack[i])) {
+	  VarDecl *TmpVar = CreateTmpVar(Result->getType());
+	  LoopStack[i].Hoisted.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(TmpVar), Result).get());
+	  return CreateSimpleDeclRef(TmpVar);
+	}
+      }
+      return Result;
+    }
+    // for(i = first; i OP bound; ++i or --i) with an invariant bound
+    struct CountedLoop {
+      VarDecl *IV;
+      bool Forward;
+      BinaryOperatorKind CondOp;
+      Expr *Bound;
+    };
+    // A loop that copies a range of a shared array to or from
+    // private memory, or fills it with a byte value:
+    //   for(i = first; i < bound; ++i) Shared[e + i] = Private[f + i];
+    // Loops that count down from the last element are also accepted.
+    struct LoopIdiom : CountedLoop {
+      ArraySubscriptExpr *SharedElement;
+      ArraySubscriptExpr *PrivateElement;  // NULL for a fill
+      Expr *Value;  // The byte for a fill
+      bool IsGet;
+    };
+    bool isLoopVariable(Expr *E, VarDecl *IV) {
+      DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts());
+      return DRE && DRE->getDecl() == IV;
+    }
+    // Checks that an index is i, i + e, e + i or i - e
+    bool isUnitStrideIndex(Expr *E, VarDecl *IV, const LoopHoistInfo& Loop) {
+      E = E->IgnoreParenImpCasts();
+      if(isLoopVariable(E, IV))
+	return true;
+      BinaryOperator *BO = dyn_cast<BinaryOperator>(E);
+      if(!BO)
+	return false;
+      if(BO->getOpcode() == BO_Add)
+	return (isLoopVariable(BO->getLHS(), IV) && isLoopInvariant(BO->getRHS(), Loop)) ||
+	  (isLoopVariable(BO->getRHS(), IV) && isLoopInvariant(BO->getLHS(), Loop));
+      if(BO->getOpcode() == BO_Sub)
+	return isLoopVariable(BO->getLHS(), IV) && isLoopInvariant(BO->getRHS(), Loop);
+      return false;
+    }
+    // The elements of a shared array that the loop touches are
+    // next to each other if the array is indefinite or they are
+    // in the same block, which is checked at run time.
+    bool isContiguousSharedElement(ArraySubscriptExpr *E, VarDecl *IV, const LoopHoistInfo& Loop) {
+      if(!isPointerToShared(E->getBase()->getType()))
+	return false;
+      QualType Ty = E->getType();
+      uint32_t BlockSize = Ty.getQualifiers().getLayoutQualifier();
+      if(Ty->isArrayType() || Ty->isIncompleteType() || isPointerToShared(Ty) ||
+	 Ty.getQualifiers().hasStrict() || Ty.isVolatileQualified() ||
+	 (BlockSize == 1 && Options.StaticThreads != 1))
+	return false;
+      return isLoopInvariant(E->getBase(), Loop) && isUnitStrideIndex(E->getIdx(), IV, Loop);
+    }
+    bool isContiguousPrivateElement(ArraySubscriptExpr *E, VarDecl *IV, const LoopHoistInfo& Loop) {
+      Expr *Base = E->getBase()->IgnoreParens();
+      if(isPointerToShared(Base->getType()) || E->getType().isVolatileQualified())
+	return false;
+      // Storing through an array does not change where it is
+      bool Invariant = isLoopInvariant(Base, Loop);
+      if(ImplicitCastExpr *Decay = dyn_cast<ImplicitCastExpr>(Base)) {
+	DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(Decay->getSubExpr()->IgnoreParens());
+	if(Decay->getCastKind() == CK_ArrayToPointerDecay && DRE && isa<VarDecl>(DRE->getDecl()))
+	  Invariant = true;
+      }
+      return Invariant && isUnitStrideIndex(E->getIdx(), IV, Loop);
+    }
+    // Matches the header of a counted loop whose body has no calls
+    // or labels and leaves the loop variable alone.  Loop is filled
+    // in with the variables that the body and the step modify.
+    bool FindCountedLoop(ForStmt *S, CountedLoop& Idiom, LoopHoistInfo& Loop) {
+      if(!S->getInit() || !S->getCond() || !S->getInc() || S->getConditionVariable())
+	return false;
+      // The loop variable and its first value
+      Expr *First = NULL;
+      Idiom.IV = NULL;
+      if(DeclStmt *DS = dyn_cast<DeclStmt>(S->getInit())) {
+	if(DS->isSingleDecl()) {
+	  Idiom.IV = dyn_cast<VarDecl>(DS->getSingleDecl());
+	  First = Idiom.IV? Idiom.IV->getInit() : NULL;
+	}
+      } else if(BinaryOperator *BO = dyn_cast<BinaryOperator>(S->getInit())) {
+	DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(BO->getLHS()->IgnoreParens());
+	if(BO->getOpcode() == BO_Assign && DRE) {
+	  Idiom.IV = dyn_cast<VarDecl>(DRE->getDecl());
+	  First = BO->getRHS();
+	}
+      }
+      if(!Idiom.IV || !First || !Idiom.IV->hasLocalStorage() ||
+	 !Idiom.IV->getType()->isIntegerType() || Idiom.IV->getType().isVolatileQualified() ||
+	 FunctionAddressTaken.count(Idiom.IV) || First->HasSideEffects(SemaRef.Context))
+	return false;
+      CheckForModifiedDecls Check;
+      Check.TraverseStmt(S->getBody());
+      if(Check.HasLabel || Check.HasCall || Check.Modified.count(Idiom.IV))
+	return false;
+      Check.TraverseStmt(S->getInc());
+      Loop.Modified.swap(Check.Modified);
+      Loop.CanHoist = true;
+      // The condition and the step
+      BinaryOperator *Cond = dyn_cast<BinaryOperator>(S->getCond()->IgnoreParens());
+      if(!Cond || !isLoopVariable(Cond->getLHS(), Idiom.IV) || !isLoopInvariant(Cond->getRHS(), Loop))
+	return false;
+      Idiom.CondOp = Cond->getOpcode();
+      Idiom.Bound = Cond->getRHS();
+      UnaryOperator *Inc = dyn_cast<UnaryOperator>(S->getInc()->IgnoreParens());
+      if(!Inc || !Inc->isIncrementDecrementOp() || !isLoopVariable(Inc->getSubExpr(), Idiom.IV))
+	return false;
+      Idiom.Forward = Inc->isIncrementOp();
+      if(Idiom.Forward? (Idiom.CondOp != BO_LT && Idiom.CondOp != BO_LE && Idiom.CondOp != BO_NE)
+		      : (Idiom.CondOp != BO_GT && Idiom.CondOp != BO_GE))
+	return false;
+      return true;
+    }
+    bool FindLoopIdiom(ForStmt *S, LoopIdiom& Idiom) {
+      LoopHoistInfo Loop;
+      if(!FindCountedLoop(S, Idiom, Loop))
+	return false;
+      // The body is a single assignment
+      Stmt *Body = S->getBody();
+      if(CompoundStmt *CS = dyn_cast<CompoundStmt>(Body)) {
+	if(CS->size() != 1)
+	  return false;
+	Body = CS->body_front();
+      }
+      BinaryOperator *Assign = dyn_cast<BinaryOperator>(Body);
+      if(Assign)
+	Assign = dyn_cast<BinaryOperator>(Assign->IgnoreParens());
+      if(!Assign || Assign->getOpcode() != BO_Assign)
+	return false;
+      ArraySubscriptExpr *LHS = dyn_cast<ArraySubscriptExpr>(Assign->getLHS()->IgnoreParens());
+      if(!LHS)
+	return false;
+      Expr *RHS = Assign->getRHS()->IgnoreParens();
+      ArraySubscriptExpr *Source = NULL;
+      if(ImplicitCastExpr *Load = dyn_cast<ImplicitCastExpr>(RHS)) {
+	if(Load->getCastKind() == CK_LValueToRValue)
+	  Source = dyn_cast<ArraySubscriptExpr>(Load->getSubExpr()->IgnoreParens());
+      }
+      Idiom.Value = NULL;
+      if(isContiguousSharedElement(LHS, Idiom.IV, Loop)) {
+	Idiom.SharedElement = LHS;
+	Idiom.IsGet = false;
+	if(Source && isContiguousPrivateElement(Source, Idiom.IV, Loop)) {
+	  Idiom.PrivateElement = Source;
+	} else {
+	  // A fill with zero, or with any byte for character arrays
+	  Idiom.PrivateElement = NULL;
+	  Idiom.Value = RHS;
+	  QualType Ty = LHS->getType();
+	  Expr *Value = RHS->IgnoreParenImpCasts();
+	  bool Zero = (isa<IntegerLiteral>(Value) && cast<IntegerLiteral>(Value)->getValue() == 0) ||
+	    (isa<FloatingLiteral>(Value) && cast<FloatingLiteral>(Value)->getValue().isPosZero());
+	  if(!(Zero && Ty->isScalarType()) &&
+	     !(Ty->isCharType() && isLoopInvariant(RHS, Loop)))
+	    return false;
+	}
+      } else if(Source && isContiguousSharedElement(Source, Idiom.IV, Loop) &&
+		isContiguousPrivateElement(LHS, Idiom.IV, Loop)) {
+	Idiom.SharedElement = Source;
+	Idiom.PrivateElement = LHS;
+	Idiom.IsGet = true;
+      } else {
+	return false;
+      }
+      if(Idiom.PrivateElement &&
+	 !SemaRef.Context.hasSameUnqualifiedType(Idiom.SharedElement->getType(), Idiom.PrivateElement->getType()))
+	return false;
+      return true;
+    }
+    // Builds a bulk transfer of the whole range in front of the loop,
+    // leaving the loop variable with its final value.  The original
+    // loop follows, and does nothing unless the range is not contiguous.
+    Stmt *BuildLoopIdiom(const LoopIdiom& Idiom, Expr *Cond) {
+      ASTContext& Context = SemaRef.Context;
+      QualType Ty = Idiom.SharedElement->getType();
+      QualType SizeType = Context.getSizeType();
+      Expr *IV = TransformExpr(CreateSimpleDeclRef(Idiom.IV)).get();
+      std::vector<Stmt*> Statements;
+      // The number of elements
+      VarDecl *Count = CreateTmpVar(Context.getPointerDiffType());
+      Expr *Bound = BuildParens(TransformExpr(Idiom.Bound).get()).get();
+      Expr *N;
+      if(Idiom.Forward) {
+	N = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Sub, Bound, IV).get();
+      } else {
+	N = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Sub, IV, Bound).get();
+      }
+      if(Idiom.CondOp == BO_LE || Idiom.CondOp == BO_GE)
+	N = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Add, N, CreateInteger(Context.IntTy, 1)).get();
+      Statements.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(Count), N).get());
+      // A loop that counts down starts at the highest element
+      Expr *Last = NULL;
+      if(!Idiom.Forward) {
+	Last = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Sub, CreateInteger(Context.getPointerDiffType(), 1), CreateSimpleDeclRef(Count)).get();
+      }
+      Expr *Ptr = TransformExpr(Idiom.SharedElement).get();
+      if(Last)
+	Ptr = BuildSharedPointerAdd(Ptr, Ty, Context.getTypeSizeInChars(Ty).getQuantity(), Last).get();
+      if(isPhaseless(Ty))
+	Ptr = BuildUPCRPsharedToShared(Ptr).get();
+      VarDecl *PtrVar = CreateTmpVar(Decls->upcr_shared_ptr_t);
+      Statements.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(PtrVar), Ptr).get());
+      Expr *Size = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Mul, CreateSimpleDeclRef(Count),
+					      CreateInteger(SizeType, Context.getTypeSizeInChars(Ty).getQuantity())).get();
+      std::vector<Expr*> args;
+      if(Idiom.PrivateElement) {
+	Expr *Private = SemaRef.CreateBuiltinUnaryOp(SourceLocation(), UO_AddrOf, TransformExpr(Idiom.PrivateElement).get()).get();
+	if(Last)
+	  Private = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Add, Private, Last).get();
+	if(Idiom.IsGet) {
+	  args.push_back(Private);
+	  args.push_back(CreateSimpleDeclRef(PtrVar));
+	} else {
+	  args.push_back(CreateSimpleDeclRef(PtrVar));
+	  args.push_back(Private);
+	}
+      } else {
+	args.push_back(CreateSimpleDeclRef(PtrVar));
+	args.push_back(TransformExpr(Idiom.Value).get());
+      }
+      args.push_back(Size);
+      FunctionDecl *Fn = Idiom.PrivateElement? (Idiom.IsGet? Decls->upcr_memget : Decls->upcr_memput) : Decls->upcr_memset;
+      std::vector<Stmt*> Bulk;
+      Bulk.push_back(BuildUPCRCall(Fn, args).get());
+      // The first value that fails the condition
+      Expr *Final;
+      if(Idiom.CondOp == BO_LE) {
+	Final = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Add, Bound, CreateInteger(Context.IntTy, 1)).get();
+      } else if(Idiom.CondOp == BO_GE) {
+	Final = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Sub, Bound, CreateInteger(Context.IntTy, 1)).get();
+      } else {
+	Final = Bound;
+      }
+      Bulk.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, TransformExpr(CreateSimpleDeclRef(Idiom.IV)).get(), Final).get());
+      Sema::CompoundScopeRAII BodyScope(SemaRef);
+      StmtResult BulkBody;
+      {
+	Sema::CompoundScopeRAII BulkScope(SemaRef);
+	BulkBody = SemaRef.ActOnCompoundStmt(SourceLocation(), SourceLocation(), Bulk, false);
+      }
+      Stmt *Result = BulkBody.get();
+      uint32_t BlockSize = Ty.getQualifiers().getLayoutQualifier();
+      if(BlockSize > 1) {
+	// Every element must be in the same block
+	std::vector<Expr*> phaseArgs;
+	phaseArgs.push_back(CreateSimpleDeclRef(PtrVar));
+	Expr *End = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Add, BuildUPCRCall(Decls->upcr_phaseof_shared, phaseArgs).get(), CreateSimpleDeclRef(Count)).get();
+	Expr *Guard = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_LE, End, CreateInteger(SizeType, BlockSize)).get();
+	Sema::ConditionResult GuardCond = SemaRef.ActOnCondition(nullptr, SourceLocation(), Guard, Sema::ConditionKind::Boolean);
+	Result = SemaRef.ActOnIfStmt(SourceLocation(), false, nullptr, GuardCond, Result, SourceLocation(), nullptr).get();
+      }
+      Statements.push_back(Result);
+      StmtResult Then = SemaRef.ActOnCompoundStmt(SourceLocation(), SourceLocation(), Statements, false);
+      Sema::ConditionResult Check = SemaRef.ActOnCondition(nullptr, SourceLocation(), Cond, Sema::ConditionKind::Boolean);
+      return SemaRef.ActOnIfStmt(SourceLocation(), false, nullptr, Check, Then.get(), SourceLocation(), nullptr).get();
+    }
+    // Shared reads in the original AST that are replaced by an element
+    // of a buffer filled for a strip of iterations, and the index of
+    // the iteration within the strip
+    std::map<Expr*, std::pair<VarDecl*, VarDecl*> > GatheredLoads;
+    static const int GatherStripSize = 256;
+    static const std::size_t MaxGathers = 4;
+    // Finds the indirect reads of a counted loop that can be issued
+    // for a whole strip of iterations before any of them runs.
+    bool FindGatherPlan(ForStmt *S, CountedLoop& Counted, std::vector<ImplicitCastExpr*>& Gathers) {
+      LoopHoistInfo Loop;
+      if(!FindCountedLoop(S, Counted, Loop))
+	return false;
+      FindGatherReads Find(SemaRef.Context, Counted.IV);
+      Find.Scan(S->getBody(), false, false);
+      if(Find.Unsafe || Find.Reads.empty() || Find.MayChangeIndices())
+	return false;
+      SharedAccessSummary Summary(SemaRef.Context);
+      Summary.TraverseStmt(S->getBody());
+      std::set<VarDecl*> Stored;
+      bool AnyPointer = false;
+      Summary.AddStores(Stored, AnyPointer);
+      if(Summary.HasStrict || AnyPointer)
+	return false;
+      CheckForModifiedDecls Modified;
+      Modified.TraverseStmt(S->getBody());
+      for(std::size_t i = 0; i < Find.Reads.size() && Gathers.size() < MaxGathers; ++i) {
+	Expr *LValue = Find.Reads[i]->getSubExpr();
+	// The element and its index may not be written by the body
+	bool Literal;
+	VarDecl *Root = GetAccessRoot(SemaRef.Context, LValue, Literal);
+	if(Root? Stored.count(Root) != 0 : !Stored.empty())
+	  continue;
+	CheckForUnstableRefs Refs(FunctionAddressTaken);
+	Refs.TraverseStmt(LValue);
+	bool Changed = Refs.Found;
+	for(std::set<Decl*>::iterator iter = Refs.Vars.begin(), end = Refs.Vars.end(); iter != end; ++iter) {
+	  if(Modified.Modified.count(*iter))
+	    Changed = true;
+	}
+	if(!Changed)
+	  Gathers.push_back(Find.Reads[i]);
+      }
+      return !Gathers.empty();
+    }
+    // for(Index = 0; Index < GatherStripSize && cond; Index++, inc) Body
+    Stmt *BuildStripLoop(ForStmt *S, VarDecl *Index, Stmt *Body) {
+      Expr *Init = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(Index), CreateInteger(SemaRef.Context.IntTy, 0)).get();
+      Expr *InStrip = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_LT, CreateSimpleDeclRef(Index), CreateInteger(SemaRef.Context.IntTy, GatherStripSize)).get();
+      Expr *Test = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_LAnd, InStrip, BuildParens(TransformExpr(S->getCond()).get()).get()).get();
+      Sema::ConditionResult Cond = SemaRef.ActOnCondition(nullptr, SourceLocation(), Test, Sema::ConditionKind::Boolean);
+      Expr *Next = SemaRef.CreateBuiltinUnaryOp(SourceLocation(), UO_PostInc, CreateSimpleDeclRef(Index)).get();
+      Expr *Inc = BuildComma(Next, TransformExpr(S->getInc()).get()).get();
+      Sema::FullExprArg FullInc(SemaRef.MakeFullExpr(Inc));
+      return SemaRef.ActOnForStmt(SourceLocation(), SourceLocation(), Init, Cond, FullInc, SourceLocation(), Body).get();
+    }
+    // Records the addresses of the gathers of a strip of iterations,
+    // fetches each gather with upcrt_gather, which sorts the addresses
+    // by owning thread and issues one list transfer per thread, and
+    // then runs the iterations from the start of the strip.
+    Stmt *BuildGatherStrip(ForStmt *S, const CountedLoop& Counted, const std::vector<ImplicitCastExpr*>& Gathers, VarDecl *Index, Stmt *Body) {
+      Sema::CompoundScopeRAII BodyScope(SemaRef);
+      std::vector<Stmt*> Statements;
+      VarDecl *Start = CreateTmpVar(Counted.IV->getType().getUnqualifiedType());
+      Statements.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(Start), TransformExpr(CreateSimpleDeclRef(Counted.IV)).get()).get());
+      QualType AddressesTy = SemaRef.Context.getConstantArrayType(Decls->upcr_shared_ptr_t, APInt(32, GatherStripSize), ArrayType::Normal, 0);
+      std::vector<VarDecl*> Addresses;
+      std::vector<Stmt*> Inspect;
+      for(std::size_t i = 0; i < Gathers.size(); ++i) {
+	Addresses.push_back(CreateTmpVar(AddressesTy));
+	Expr *Ptr = TransformExpr(Gathers[i]->getSubExpr()).get();
+	if(isPhaseless(Gathers[i]->getSubExpr()->getType()))
+	  Ptr = BuildUPCRPsharedToShared(Ptr).get();
+	Expr *Address = SemaRef.CreateBuiltinArraySubscriptExpr(CreateSimpleDeclRef(Addresses[i]), SourceLocation(), CreateSimpleDeclRef(Index), SourceLocation()).get();
+	Inspect.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, Address, Ptr).get());
+      }
+      StmtResult InspectBody;
+      {
+	Sema::CompoundScopeRAII InspectScope(SemaRef);
+	InspectBody = SemaRef.ActOnCompoundStmt(SourceLocation(), SourceLocation(), Inspect, false);
+      }
+      Statements.push_back(BuildStripLoop(S, Index, InspectBody.get()));
+      // Index is now the number of iterations in the strip
+      for(std::size_t i = 0; i < Gathers.size(); ++i) {
+	QualType Ty = Gathers[i]->getSubExpr()->getType();
+	std::vector<Expr*> args;
+	args.push_back(CreateSimpleDeclRef(GatheredLoads[Gathers[i]].first));
+	args.push_back(CreateSimpleDeclRef(Addresses[i]));
+	args.push_back(CreateSimpleDeclRef(Index));
+	args.push_back(CreateInteger(SemaRef.Context.getSizeType(), SemaRef.Context.getTypeSizeInChars(Ty).getQuantity()));
+	Statements.push_back(BuildUPCRCall(Decls->upcrt_gather, args).get());
+      }
+      Statements.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, TransformExpr(CreateSimpleDeclRef(Counted.IV)).get(), CreateSimpleDeclRef(Start)).get());
+      Statements.push_back(BuildStripLoop(S, Index, Body));
+      return SemaRef.ActOnCompoundStmt(SourceLocation(), SourceLocation(), Statements, false).get();
+    }
+    StmtResult TransformForStmt(ForStmt *S) {
+      if(S->getInc()) MarkResultUnused(S->getInc());
+      LoopIdiom Idiom;
+      if(FindLoopIdiom(S, Idiom)) {
+	Sema::CompoundScopeRAII BodyScope(SemaRef);
+	EnterLoop(S);
+	StmtResult Loop = TreeTransformUPC::TransformForStmt(S);
+	if(Loop.isInvalid()) {
+	  LoopStack.pop_back();
+	  return Loop;
+	}
+	// The initialization goes in front of the bulk transfer
+	ForStmt *NewLoop = cast<ForStmt>(Loop.get());
+	std::vector<Stmt*> Statements;
+	Statements.push_back(NewLoop->getInit());
+	NewLoop->setInit(NULL);
+	Loop = ExitLoop(Loop);
+	Statements.push_back(BuildLoopIdiom(Idiom, TransformExpr(S->getCond()).get()));
+	Statements.push_back(Loop.get());
+	return SemaRef.ActOnCompoundStmt(SourceLocation(), SourceLocation(), Statements, false);
+      }
+      // Inspector-executor for indirect reads, strip by strip:
+      //   for(init; cond; ) { record addresses; gather; run iterations }
+      CountedLoop Counted;
+      std::vector<ImplicitCastExpr*> Gathers;
+      if(FindGatherPlan(S, Counted, Gathers)) {
+	haveGather = true;
+	VarDecl *Index = CreateTmpVar(SemaRef.Context.IntTy);
+	for(std::size_t i = 0; i < Gathers.size(); ++i) {
+	  QualType Ty = TransformType(Gathers[i]->getType()).getUnqualifiedType();
+	  VarDecl *Buffer = CreateTmpVar(SemaRef.Context.getConstantArrayType(Ty, APInt(32, GatherStripSize), ArrayType::Normal, 0));
+	  GatheredLoads[Gathers[i]] = std::make_pair(Buffer, Index);
+	}
+	EnterLoop(S);
+	StmtResult Loop = TreeTransformUPC::TransformForStmt(S);
+	if(!Loop.isInvalid()) {
+	  ForStmt *NewLoop = cast<ForStmt>(Loop.get());
+	  NewLoop->setBody(BuildGatherStrip(S, Counted, Gathers, Index, NewLoop->getBody()));
+	  NewLoop->setInc(NULL);
+	}
+	for(std::size_t i = 0; i < Gathers.size(); ++i)
+	  GatheredLoads.erase(Gathers[i]);
+	return ExitLoop(Loop);
+      }
+      EnterLoop(S);
+      return ExitLoop(TreeTransformUPC::TransformForStmt(S));
+    }
+    StmtResult TransformWhileStmt(WhileStmt *S) {
+      EnterLoop(S);
+      return ExitLoop(TreeTransformUPC::TransformWhileStmt(S));
+    }
+    StmtResult TransformDoStmt(DoStmt *S) {
+      EnterLoop(S);
+      return ExitLoop(TreeTransformUPC::TransformDoStmt(S));
+    }
     StmtResult TransformUPCForAllStmt(UPCForAllStmt *S) {
+      if(S->getInc()) MarkResultUnused(S->getInc());
+      EnterLoop(S);
+      return ExitLoop(BuildUPCForAllStmt(S));
+    }
+    // Ghost cells for the neighbors of the affinity element in
+    // the body of the upc_forall that is being transformed.
+    struct HaloPlan {
+      VarDecl *IV;
+      Expr *Address;  // The affinity expression &a[i]
+      ArraySubscriptExpr *Affinity;
+      int64_t BlockSize;
+      int64_t Left;  // Number of neighbors below the block
+      int64_t Right;  // Number of neighbors above the block
+      VarDecl *Local;  // Private pointer to the affinity element
+      VarDecl *Phase;
+      VarDecl *Block;  // Index of the first element of the block
+      VarDecl *Count;
+      VarDecl *LeftCells;
+      VarDecl *RightCells;
+    };
+    HaloPlan Halo;
+    // Reads of neighbors in the original AST and their offsets
+    std::map<Expr*, int64_t> HaloReads;
+    static const int64_t MaxHaloWidth = 16;
+    // Recognizes upc_forall(i = ...; ...; ++i; &a[i]) where a is a
+    // blocked shared array that the body reads at i + c, but never
+    // writes.  Only the neighbors outside the block of a[i] can be
+    // remote, so they are fetched once per block.
+    //
+    // Only one dimensional arrays are handled.  The neighbors of a
+    // row-major a[i][j] at i +- 1 are a whole row away in the
+    // linearized index, which needs a ghost row per block rather than
+    // a few cells, so such stencils keep their element-wise gets.
+    bool FindHaloPlan(UPCForAllStmt *S) {
+      UnaryOperator *AddrOf = dyn_cast_or_null<UnaryOperator>(S->getAfnty()? S->getAfnty()->IgnoreParenImpCasts() : NULL);
+      UnaryOperator *Inc = dyn_cast_or_null<UnaryOperator>(S->getInc()? S->getInc()->IgnoreParens() : NULL);
+      if(!AddrOf || AddrOf->getOpcode() != UO_AddrOf || !Inc || !Inc->isIncrementOp())
+	return false;
+      ArraySubscriptExpr *Affinity = dyn_cast<ArraySubscriptExpr>(AddrOf->getSubExpr()->IgnoreParens());
+      DeclRefExpr *IVRef = dyn_cast<DeclRefExpr>(Inc->getSubExpr()->IgnoreParenImpCasts());
+      VarDecl *IV = IVRef? dyn_cast<VarDecl>(IVRef->getDecl()) : NULL;
+      if(!Affinity || !IV || !FindHaloReads::isVariable(Affinity->getIdx(), IV))
+	return false;
+      DeclRefExpr *ArrayRef = dyn_cast<DeclRefExpr>(Affinity->getBase()->IgnoreParenImpCasts());
+      VarDecl *Array = ArrayRef? dyn_cast<VarDecl>(ArrayRef->getDecl()) : NULL;
+      if(!IV->hasLocalStorage() || !IV->getType()->isIntegerType() ||
+	 IV->getType().isVolatileQualified() || FunctionAddressTaken.count(IV) || !Array)
+	return false;
+      // A one dimensional array whose size is known; see above
+      const ArrayType *AT = SemaRef.Context.getAsArrayType(Array->getType());
+      if(!AT || (!isa<ConstantArrayType>(AT) && !isa<UPCThreadArrayType>(AT)) ||
+	 AT->getElementType()->isArrayType())
+	return false;
+      QualType Ty = Affinity->getType();
+      uint32_t BlockSize = Ty.getQualifiers().getLayoutQualifier();
+      if(BlockSize < 2 || !Ty->isScalarType() || isPointerToShared(Ty) ||
+	 Ty.getQualifiers().hasStrict() || Ty.isVolatileQualified())
+	return false;
+      // The body may not change i or write the array
+      CheckForModifiedDecls Modified;
+      Modified.TraverseStmt(S->getBody());
+      SharedAccessSummary Summary(SemaRef.Context);
+      Summary.TraverseStmt(S->getBody());
+      std::set<VarDecl*> Stored;
+      bool AnyPointer = false;
+      Summary.AddStores(Stored, AnyPointer);
+      FindHaloReads Find(IV, Array, std::min<int64_t>(BlockSize, MaxHaloWidth));
+      Find.TraverseStmt(S->getBody());
+      if(Modified.Modified.count(IV) || Summary.HasStrict || AnyPointer || Stored.count(Array) || Find.Unsafe)
+	return false;
+      Halo.IV = IV;
+      Halo.Address = S->getAfnty();
+      Halo.Affinity = Affinity;
+      Halo.BlockSize = BlockSize;
+      Halo.Left = Halo.Right = 0;
+      for(std::size_t i = 0; i < Find.Reads.size(); ++i) {
+	Halo.Left = std::max(Halo.Left, -Find.Reads[i].second);
+	Halo.Right = std::max(Halo.Right, Find.Reads[i].second);
+      }
+      if(Halo.Left == 0 && Halo.Right == 0)
+	return false;
+      for(std::size_t i = 0; i < Find.Reads.size(); ++i)
+	HaloReads[Find.Reads[i].first] = Find.Reads[i].second;
+      QualType ElemTy = TransformType(Ty).getUnqualifiedType();
+      QualType PtrDiff = SemaRef.Context.getPointerDiffType();
+      Halo.Local = CreateTmpVar(SemaRef.Context.getPointerType(ElemTy));
+      Halo.Phase = CreateTmpVar(PtrDiff);
+      Halo.Block = CreateTmpVar(PtrDiff);
+      Halo.Count = CreateTmpVar(PtrDiff);
+      Halo.LeftCells = Halo.Left? CreateTmpVar(SemaRef.Context.getConstantArrayType(ElemTy, APInt(32, Halo.Left), ArrayType::Normal, 0)) : NULL;
+      Halo.RightCells = Halo.Right? CreateTmpVar(SemaRef.Context.getConstantArrayType(ElemTy, APInt(32, Halo.Right), ArrayType::Normal, 0)) : NULL;
+      // No block has been fetched yet
+      Expr *NoBlock = SemaRef.CreateBuiltinUnaryOp(SourceLocation(), UO_Minus, CreateInteger(PtrDiff, 1)).get();
+      LoopStack.back().Before.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(Halo.Block), NoBlock).get());
+      return true;
+    }
+    Expr *BuildHaloElement(VarDecl *Cells, Expr *Index) {
+      return SemaRef.CreateBuiltinArraySubscriptExpr(CreateSimpleDeclRef(Cells), SourceLocation(), Index, SourceLocation()).get();
+    }
+    // Fetches Count elements of the array starting at Start into Cells
+    Stmt *BuildHaloFetch(VarDecl *Cells, Expr *CellIndex, Expr *Start) {
+      QualType Ty = Halo.Affinity->getType();
+      int64_t ElementSize = SemaRef.Context.getTypeSizeInChars(Ty).getQuantity();
+      Expr *Ptr = BuildSharedPointerAdd(TransformExpr(Halo.Affinity->getBase()).get(), Ty, ElementSize, Start).get();
+      std::vector<Expr*> args;
+      args.push_back(SemaRef.CreateBuiltinUnaryOp(SourceLocation(), UO_AddrOf, BuildHaloElement(Cells, CellIndex)).get());
+      args.push_back(Ptr);
+      args.push_back(CreateInteger(SemaRef.Context.getSizeType(), 0));
+      args.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Mul, CreateSimpleDeclRef(Halo.Count), CreateInteger(SemaRef.Context.getSizeType(), ElementSize)).get());
+      Expr *Get = BuildUPCRCall(Decls->UPCR_GET(false), args).get();
+      Expr *Test = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_GT, CreateSimpleDeclRef(Halo.Count), CreateInteger(SemaRef.Context.getPointerDiffType(), 0)).get();
+      Sema::ConditionResult Cond = SemaRef.ActOnCondition(nullptr, SourceLocation(), Test, Sema::ConditionKind::Boolean);
+      return SemaRef.ActOnIfStmt(SourceLocation(), false, nullptr, Cond, Get, SourceLocation(), nullptr).get();
+    }
+    // Sets up the pointer to the affinity element, and fetches the
+    // neighbors of its block when i enters a new block.
+    Stmt *BuildHaloBody(Stmt *Body) {
+      ASTContext& Context = SemaRef.Context;
+      QualType PtrDiff = Context.getPointerDiffType();
+      Expr *IV = TransformExpr(CreateSimpleDeclRef(Halo.IV)).get();
+      std::vector<Stmt*> Statements;
+      std::vector<Expr*> args;
+      args.push_back(TransformExpr(Halo.Address).get());
+      Expr *Local = BuildUPCRCall(Decls->UPCR_SHARED_TO_LOCAL, args).get();
+      TypeSourceInfo *PtrType = Context.getTrivialTypeSourceInfo(Halo.Local->getType());
+      Local = SemaRef.BuildCStyleCastExpr(SourceLocation(), PtrType, SourceLocation(), Local).get();
+      Statements.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(Halo.Local), Local).get());
+      Expr *Phase = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Rem, IV, CreateInteger(PtrDiff, Halo.BlockSize)).get();
+      Statements.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(Halo.Phase), Phase).get());
+      Expr *Start = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Sub, TransformExpr(CreateSimpleDeclRef(Halo.IV)).get(), CreateSimpleDeclRef(Halo.Phase)).get();
+      std::vector<Stmt*> Fetch;
+      Fetch.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(Halo.Block), Start).get());
+      if(Halo.Left) {
+	// The end of the previous block, which may not exist
+	Expr *Width = CreateInteger(PtrDiff, Halo.Left);
+	Expr *Small = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_LT, CreateSimpleDeclRef(Halo.Block), Width).get();
+	Expr *Count = SemaRef.ActOnConditionalOp(SourceLocation(), SourceLocation(), Small, CreateSimpleDeclRef(Halo.Block), CreateInteger(PtrDiff, Halo.Left)).get();
+	Fetch.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(Halo.Count), Count).get());
+	Expr *CellIndex = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Sub, CreateInteger(PtrDiff, Halo.Left), CreateSimpleDeclRef(Halo.Count)).get();
+	Expr *First = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Sub, CreateSimpleDeclRef(Halo.Block), CreateSimpleDeclRef(Halo.Count)).get();
+	Fetch.push_back(BuildHaloFetch(Halo.LeftCells, CellIndex, First));
+      }
+      if(Halo.Right) {
+	// The start of the next block, up to the end of the array
+	ArrayDimensionT Dims = GetArrayDimension(cast<DeclRefExpr>(Halo.Affinity->getBase()->IgnoreParenImpCasts())->getDecl()->getType());
+	Expr *Size = IntegerLiteral::Create(Context, llvm::APInt(Context.getTypeSize(PtrDiff), Dims.ArrayDimension.getZExtValue()), PtrDiff, SourceLocation());
+	if(Dims.HasThread)
+	  Size = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Mul, Size, BuildUPCRThreads()).get();
+	Expr *Next = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Add, CreateSimpleDeclRef(Halo.Block), CreateInteger(PtrDiff, Halo.BlockSize)).get();
+	Expr *Count = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Sub, Size, BuildParens(Next).get()).get();
+	Fetch.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(Halo.Count), Count).get());
+	Expr *Large = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_GT, CreateSimpleDeclRef(Halo.Count), CreateInteger(PtrDiff, Halo.Right)).get();
+	Sema::ConditionResult Cond = SemaRef.ActOnCondition(nullptr, SourceLocation(), Large, Sema::ConditionKind::Boolean);
+	Stmt *Clip = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, CreateSimpleDeclRef(Halo.Count), CreateInteger(PtrDiff, Halo.Right)).get();
+	Fetch.push_back(SemaRef.ActOnIfStmt(SourceLocation(), false, nullptr, Cond, Clip, SourceLocation(), nullptr).get());
+	Next = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Add, CreateSimpleDeclRef(Halo.Block), CreateInteger(PtrDiff, Halo.BlockSize)).get();
+	Fetch.push_back(BuildHaloFetch(Halo.RightCells, CreateInteger(PtrDiff, 0), Next));
+      }
+      Sema::CompoundScopeRAII BodyScope(SemaRef);
+      StmtResult FetchBody;
+      {
+	Sema::CompoundScopeRAII FetchScope(SemaRef);
+	FetchBody = SemaRef.ActOnCompoundStmt(SourceLocation(), SourceLocation(), Fetch, false);
+      }
+      Start = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Sub, TransformExpr(CreateSimpleDeclRef(Halo.IV)).get(), CreateSimpleDeclRef(Halo.Phase)).get();
+      Expr *NewBlock = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_NE, Start, CreateSimpleDeclRef(Halo.Block)).get();
+      Sema::ConditionResult Cond = SemaRef.ActOnCondition(nullptr, SourceLocation(), NewBlock, Sema::ConditionKind::Boolean);
+      Statements.push_back(SemaRef.ActOnIfStmt(SourceLocation(), false, nullptr, Cond, FetchBody.get(), SourceLocation(), nullptr).get());
+      Statements.push_back(Body);
+      return SemaRef.ActOnCompoundStmt(SourceLocation(), SourceLocation(), Statements, false).get();
+    }
+    // Reads a neighbor from the block of a[i], or from the ghost cells
+    Expr *BuildHaloRead(int64_t Offset) {
+      QualType PtrDiff = SemaRef.Context.getPointerDiffType();
+      Expr *Index = CreateInteger(PtrDiff, Offset < 0? -Offset : Offset);
+      if(Offset < 0)
+	Index = SemaRef.CreateBuiltinUnaryOp(SourceLocation(), UO_Minus, Index).get();
+      Expr *Local = SemaRef.CreateBuiltinArraySubscriptExpr(CreateSimpleDeclRef(Halo.Local), SourceLocation(), Index, SourceLocation()).get();
+      if(Offset == 0)
+	return Local;
+      Expr *InBlock, *Ghost;
+      if(Offset < 0) {
+	InBlock = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_GE, CreateSimpleDeclRef(Halo.Phase), CreateInteger(PtrDiff, -Offset)).get();
+	Ghost = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Add, CreateSimpleDeclRef(Halo.Phase), CreateInteger(PtrDiff, Halo.Left + Offset)).get();
+	Ghost = BuildHaloElement(Halo.LeftCells, Ghost);
+      } else {
+	InBlock = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_LT, CreateSimpleDeclRef(Halo.Phase), CreateInteger(PtrDiff, Halo.BlockSize - Offset)).get();
+	Ghost = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Sub, CreateSimpleDeclRef(Halo.Phase), CreateInteger(PtrDiff, Halo.BlockSize - Offset)).get();
+	Ghost = BuildHaloElement(Halo.RightCells, Ghost);
+      }
+      return BuildParens(SemaRef.ActOnConditionalOp(SourceLocation(), SourceLocation(), InBlock, Local, Ghost).get()).get();
+    }
+    StmtResult BuildUPCForAllStmt(UPCForAllStmt *S) {
       // Transform the initialization statement
       StmtResult Init = getDerived().TransformStmt(S->getInit());
 
@@ -1391,8 +4497,20 @@ namespace {
       
       Sema::FullExprArg FullInc(getSema().MakeFullExpr(Inc.get()));
 
+      // Neighbors of the affinity element are only local if the
+      // affinity test is certain to be applied
+      bool UseHalo = S->getAfnty() && ForAllDepth == 0 &&
+	CurForAllContext == UPCCallGraph::FAC_Outside && FindHaloPlan(S);
+
       // Transform the body
+      if(S->getAfnty()) ++ForAllDepth;
       StmtResult Body = TransformStmt(S->getBody());
+      if(S->getAfnty()) --ForAllDepth;
+      if(UseHalo) {
+	HaloReads.clear();
+	if(!Body.isInvalid())
+	  Body = BuildHaloBody(Body.get());
+      }
 
       StmtResult PlainFor = SemaRef.ActOnForStmt(S->getForLoc(), S->getLParenLoc(),
 						 Init.get(), Cond,
@@ -1404,6 +4522,12 @@ namespace {
 	return PlainFor;
       }
 
+      // A upc_forall nested inside another one, either lexically or
+      // through every call path, also behaves like a for loop.
+      if(ForAllDepth > 0 || CurForAllContext == UPCCallGraph::FAC_Inside) {
+	return PlainFor;
+      }
+
       ExprResult Afnty = TransformExpr(S->getAfnty());
       ExprResult ThreadTest_;
       if(isPointerToShared(S->getAfnty()->getType())) {
@@ -1412,9 +4536,8 @@ namespace {
 	args.push_back(Afnty.get());
 	ThreadTest_ = BuildUPCRCall(Phaseless?Decls->upcr_hasMyAffinity_pshared:Decls->upcr_hasMyAffinity_shared, args);
       } else {
-	std::vector<Expr*> args;
-	Expr * Affinity = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Rem, BuildParens(Afnty.get()).get(), BuildUPCRCall(Decls->upcr_threads, args).get()).get();
-	ThreadTest_ = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_EQ, Affinity, BuildUPCRCall(Decls->upcr_mythread, args).get());
+	Expr * Affinity = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Rem, BuildParens(Afnty.get()).get(), BuildUPCRThreads()).get();
+	ThreadTest_ = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_EQ, Affinity, BuildUPCRMyThread());
       }
 
       Sema::ConditionResult ThreadTest = SemaRef.ActOnCondition(nullptr, SourceLocation(), ThreadTest_.get(), Sema::ConditionKind::Boolean);
@@ -1425,6 +4548,19 @@ namespace {
 						 Init.get(), Cond,
 						 FullInc, S->getRParenLoc(), UPCBody.get());
 
+      // If no call path can reach this loop from inside another
+      // upc_forall, skip the run time check.  The control flag
+      // only needs to be set if the loop calls anything that might
+      // test it.
+      bool NeedRuntimeCheck = true;
+      if(CurForAllContext == UPCCallGraph::FAC_Outside) {
+	CheckForCall Check;
+	Check.TraverseStmt(S);
+	if(!Check.Found)
+	  return UPCFor;
+	NeedRuntimeCheck = false;
+      }
+
       Expr * ForAllCtrl_ = CreateSimpleDeclRef(Decls->upcrt_forall_control);
       {
         if (SemaRef.Context.getLangOpts().UPCTLDEnable)
@@ -1445,6 +4581,10 @@ namespace {
 	UPCForWrapper = SemaRef.ActOnCompoundStmt(SourceLocation(), SourceLocation(), Statements, false);
       }
 
+      if(!NeedRuntimeCheck) {
+	return UPCForWrapper;
+      }
+
       StmtResult PlainForWrapper;
       {
 	Sema::CompoundScopeRAII BodyScope(SemaRef);
@@ -1511,17 +4651,203 @@ namespace {
 				     bool IsStmtExpr) {
       Sema::CompoundScopeRAII CompoundScope(getSema());
 
+      Stmt *SavedStmtExprResult = StmtExprResult;
+      StmtExprResult = (IsStmtExpr && !S->body_empty())? S->body_back() : NULL;
+      if (IsStmtExpr)
+	++StmtExprDepth;
+
+      RedundantLoadFinder Loads(SemaRef.Context, FunctionAddressTaken);
+      Loads.ScanBody(S);
+      // Neighbors in a upc_forall are read from ghost cells, and
+      // indirect reads in a loop from a gathered buffer
+      for (std::size_t i = Loads.Groups.size(); i-- > 0; ) {
+	if (HaloReads.count(Loads.Groups[i].First) || GatheredLoads.count(Loads.Groups[i].First))
+	  Loads.Groups.erase(Loads.Groups.begin() + i);
+      }
+      typedef std::vector<RedundantLoadFinder::LoadGroup>::const_iterator LoadIterator;
+      // Handles and values of non-blocking gets, by group
+      std::vector<std::pair<VarDecl*, VarDecl*> > SplitLoads(Loads.Groups.size());
+
+      // Barriers next to private statements become a notify before
+      // them and a wait after them.  No get may start in between.
+      std::vector<UPCBarrierStmt*> NotifyBefore(S->size() + 1), WaitBefore(S->size() + 1);
+      std::vector<bool> SplitBarrier(S->size());
+      if (Options.ElideBarriers)
+	FindRedundantBarriers(S);
+      for (unsigned i = 0, First = 0; i < S->size(); ++i) {
+	unsigned Begin, End;
+	if (!FindSplitBarrier(S, i, First, Begin, End))
+	  continue;
+	NotifyBefore[Begin] = WaitBefore[End + 1] = cast<UPCBarrierStmt>(S->body_begin()[i]);
+	SplitBarrier[i] = true;
+	for (std::size_t j = 0; j < Loads.Groups.size(); ++j) {
+	  if (Loads.Groups[j].IssueIndex > i && Loads.Groups[j].IssueIndex <= End)
+	    Loads.Groups[j].IssueIndex = End + 1;
+	}
+	First = End + 1;
+	i = End;
+      }
+
+      // Stores to neighboring elements are delayed until the last
+      // one, so no load may be started in the middle of them.
+      std::vector<SharedCluster> StoreClusters;
+      std::vector<int> InStoreCluster(S->size(), -1);
+      for (unsigned i = 0; i < S->size(); ++i) {
+	SharedCluster C;
+	if (FindStoreCluster(S, i, C)) {
+	  for (std::size_t j = 0; j < C.Members.size(); ++j)
+	    InStoreCluster[C.Members[j]] = StoreClusters.size();
+	  for (std::size_t j = 0; j < Loads.Groups.size(); ++j) {
+	    if (Loads.Groups[j].IssueIndex > i && Loads.Groups[j].IssueIndex <= C.Index)
+	      Loads.Groups[j].IssueIndex = C.Index + 1;
+	  }
+	  StoreClusters.push_back(C);
+	  i = C.Index;
+	}
+      }
+      std::vector<SharedCluster> LoadClusters;
+      std::vector<int> InLoadCluster(Loads.Groups.size(), -1);
+      FindLoadClusters(Loads, LoadClusters, InLoadCluster);
+
+      // Shared objects that may have outstanding puts
+      bool SavedDeferPuts = DeferPuts;
+      bool PendingPuts = false;
+      std::set<VarDecl*> PendingRoots;
+      bool PendingPointer = false;
+
       bool SubStmtInvalid = false;
       bool SubStmtChanged = false;
       SmallVector<Stmt*, 8> Statements;
+      unsigned Index = 0;
       for (CompoundStmt::body_iterator B = S->body_begin(), BEnd = S->body_end();
-	   B != BEnd; ++B) {
-	StmtResult Result = TransformStmt(*B);
+	   B != BEnd; ++B, ++Index) {
+	if (WaitBefore[Index]) {
+	  Statements.push_back(BuildUPCRBarrierCall(Decls->upcr_wait, WaitBefore[Index]));
+	  SubStmtChanged = true;
+	}
+	if (NotifyBefore[Index]) {
+	  if (PendingPuts) {
+	    std::vector<Expr*> args;
+	    Statements.push_back(BuildUPCRCall(Decls->upcr_wait_syncnbi_puts, args).get());
+	    PendingPuts = false;
+	    PendingRoots.clear();
+	    PendingPointer = false;
+	  }
+	  Statements.push_back(BuildUPCRBarrierCall(Decls->upcr_notify, NotifyBefore[Index]));
+	  SubStmtChanged = true;
+	}
+	// Complete outstanding puts before anything that could observe
+	// them, including gets started in front of this statement
+	DeferPuts = false;
+	bool DeadStore = false;
+	if (Options.DeferredPuts) {
+	  bool Simple = (isa<Expr>(*B) || isa<DeclStmt>(*B)) && *B != StmtExprResult;
+	  SharedAccessSummary Summary(SemaRef.Context);
+	  Summary.TraverseStmt(*B);
+	  for (LoadIterator G = Loads.Groups.begin(); G != Loads.Groups.end(); ++G) {
+	    int Cluster = InLoadCluster[G - Loads.Groups.begin()];
+	    if (Cluster >= 0? LoadClusters[Cluster].Index == Index : (G->IssueIndex == Index && UseSplitLoad(*G)))
+	      Summary.TraverseStmt(G->First);
+	  }
+	  if (PendingPuts && (!Simple || Summary.MustSyncBefore(PendingRoots, PendingPointer))) {
+	    std::vector<Expr*> args;
+	    Statements.push_back(BuildUPCRCall(Decls->upcr_wait_syncnbi_puts, args).get());
+	    PendingPuts = false;
+	    PendingRoots.clear();
+	    PendingPointer = false;
+	    SubStmtChanged = true;
+	  }
+	  if (Simple && Summary.CanDefer()) {
+	    DeferPuts = true;
+	    DeadStore = InStoreCluster[Index] < 0 && isDeadSharedStore(S, Index);
+	    Summary.AddStores(PendingRoots, PendingPointer);
+	    PendingPuts = PendingPuts || Summary.Stores > 0;
+	  }
+	}
+
+	// Fetch neighboring elements together
+	for (std::size_t i = 0; i < LoadClusters.size(); ++i) {
+	  if (LoadClusters[i].Index == Index) {
+	    Statements.push_back(BuildLoadCluster(LoadClusters[i], Loads));
+	    SubStmtChanged = true;
+	  }
+	}
+	// Start non-blocking gets as early as possible
+	for (LoadIterator G = Loads.Groups.begin(); G != Loads.Groups.end(); ++G) {
+	  if (G->IssueIndex != Index || InLoadCluster[G - Loads.Groups.begin()] >= 0 || !UseSplitLoad(*G))
+	    continue;
+	  QualType Ty = G->First->getSubExpr()->getType();
+	  VarDecl *Handle = CreateTmpVar(isNBValueGet(TransformType(Ty).getUnqualifiedType())? Decls->upcr_valget_handle_t : Decls->upcr_handle_t);
+	  VarDecl *TmpVar = CreateTmpVar(TransformType(Ty).getUnqualifiedType());
+	  Statements.push_back(BuildUPCRLoadInit(TransformExpr(G->First->getSubExpr()).get(), Ty, CreateSimpleDeclRef(Handle), CreateSimpleDeclRef(TmpVar)));
+	  SplitLoads[G - Loads.Groups.begin()] = std::make_pair(Handle, TmpVar);
+	  SubStmtChanged = true;
+	}
+	// Load values that are used more than once up front, and
+	// complete the non-blocking gets needed by this statement
+	for (LoadIterator G = Loads.Groups.begin(); G != Loads.Groups.end(); ++G) {
+	  if (G->StmtIndex != Index || InLoadCluster[G - Loads.Groups.begin()] >= 0)
+	    continue;
+	  QualType Ty = G->First->getSubExpr()->getType();
+	  VarDecl *TmpVar;
+	  if (VarDecl *Handle = SplitLoads[G - Loads.Groups.begin()].first) {
+	    TmpVar = SplitLoads[G - Loads.Groups.begin()].second;
+	    Statements.push_back(BuildUPCRLoadSync(Ty, CreateSimpleDeclRef(Handle), CreateSimpleDeclRef(TmpVar)));
+	  } else if (!G->Uses.empty() && !FindPromoted(G->First->getSubExpr())) {
+	    TmpVar = CreateTmpVar(TransformType(Ty).getUnqualifiedType());
+	    Statements.push_back(BuildUPCRLoad(TransformExpr(G->First->getSubExpr()).get(), Ty, CreateSimpleDeclRef(TmpVar)));
+	  } else {
+	    continue;
+	  }
+	  ReusedLoads[G->First] = TmpVar;
+	  for (std::size_t i = 0; i < G->Uses.size(); ++i)
+	    ReusedLoads[G->Uses[i]] = TmpVar;
+	  SubStmtChanged = true;
+	}
+
+	StmtResult Result;
+	if (InStoreCluster[Index] >= 0) {
+	  // Store into the buffer, and write it out after the last one
+	  SharedCluster& C = StoreClusters[InStoreCluster[Index]];
+	  std::size_t Member = std::find(C.Members.begin(), C.Members.end(), Index) - C.Members.begin();
+	  BinaryOperator *Store = cast<BinaryOperator>(cast<Expr>(*B)->IgnoreParens());
+	  if (!C.Buffer)
+	    C.Buffer = CreateClusterBuffer(C);
+	  Expr *RHS = TransformExpr(Store->getRHS()).get();
+	  Result = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, BuildStagedAccess(GetStagedAccess(C, Member)), RHS);
+	  if (Index == C.Index) {
+	    Statements.push_back(Result.get());
+	    Result = BuildStoreCluster(C);
+	  }
+	  SubStmtChanged = true;
+	} else if (SplitBarrier[Index] || ElidedBarriers.count(*B)) {
+	  Result = SemaRef.ActOnNullStmt(SourceLocation());
+	  SubStmtChanged = true;
+	} else if (DeadStore) {
+	  // Overwritten before anyone can see it
+	  Expr *RHS = cast<BinaryOperator>(cast<Expr>(*B)->IgnoreParens())->getRHS();
+	  if (RHS->HasSideEffects(SemaRef.Context)) {
+	    Result = TransformStmt(RHS);
+	  } else {
+	    Result = SemaRef.ActOnNullStmt(SourceLocation());
+	  }
+	  SubStmtChanged = true;
+	} else {
+	  std::size_t TempMark = StmtTemps.size();
+	  Result = TransformStmt(*B);
+	  ReleaseStmtTemps(TempMark);
+	}
+	DeferPuts = false;
 	if (Result.isInvalid()) {
 	  // Immediately fail if this was a DeclStmt, since it's very
 	  // likely that this will cause problems for future statements.
-	  if (isa<DeclStmt>(*B))
+	  if (isa<DeclStmt>(*B)) {
+	    StmtExprResult = SavedStmtExprResult;
+	    DeferPuts = SavedDeferPuts;
+	    if (IsStmtExpr)
+	      --StmtExprDepth;
 	    return StmtError();
+	  }
 
 	  // Otherwise, just keep processing substatements and fail later.
 	  SubStmtInvalid = true;
@@ -1541,6 +4867,16 @@ namespace {
 
 	Statements.push_back(Result.getAs<Stmt>());
       }
+      StmtExprResult = SavedStmtExprResult;
+      DeferPuts = SavedDeferPuts;
+      if (IsStmtExpr)
+	--StmtExprDepth;
+      if (WaitBefore[S->size()])
+	Statements.push_back(BuildUPCRBarrierCall(Decls->upcr_wait, WaitBefore[S->size()]));
+      if (PendingPuts) {
+	std::vector<Expr*> args;
+	Statements.push_back(BuildUPCRCall(Decls->upcr_wait_syncnbi_puts, args).get());
+      }
 
       if (SubStmtInvalid)
 	return StmtError();
@@ -1555,6 +4891,8 @@ namespace {
 					      IsStmtExpr);
     }
     StmtResult TransformReturnStmt(ReturnStmt * S) {
+      if(!NeedsFunctionFrame)
+	return TreeTransformUPC::TransformReturnStmt(S);
       Expr * Result = S->getRetValue();
       if(Result)
 	Result = TransformExpr(Result).get();
@@ -1568,7 +4906,7 @@ namespace {
 	Result = NULL;
       }
       if(!ResultType->isVoidType() && Result) {
-	VarDecl *D = CreateTmpVar(ResultType);
+	VarDecl *D = CreateTmpVar(ResultType, true);
 	Expr *V = CreateSimpleDeclRef(D);
 	Statements.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, V, Result).get());
 	Result = V;
@@ -1581,13 +4919,39 @@ namespace {
       // #pragma upc should be stripped out
       return SemaRef.ActOnNullStmt(SourceLocation());
     }
-    VarDecl *CreateTmpVar(QualType Ty) {
+    // A temporary whose value is only needed within the statement
+    // being transformed is StmtScoped.  It is returned to FreeTemps
+    // after the statement, and later statements reuse it.
+    VarDecl *CreateTmpVar(QualType Ty, bool StmtScoped = false) {
+      if(StmtScoped) {
+	std::vector<VarDecl*>& Free = FreeTemps[SemaRef.Context.getCanonicalType(Ty).getAsOpaquePtr()];
+	if(!Free.empty()) {
+	  VarDecl *TmpVar = Free.back();
+	  Free.pop_back();
+	  StmtTemps.push_back(TmpVar);
+	  return TmpVar;
+	}
+      }
       int ID = static_cast<int>(LocalTemps.size());
       std::string name = (llvm::Twine("_bupc_spilld") + llvm::Twine(ID)).str();
       VarDecl *TmpVar = VarDecl::Create(SemaRef.Context, SemaRef.getFunctionLevelDeclContext(), SourceLocation(), SourceLocation(), &SemaRef.Context.Idents.get(name), Ty, SemaRef.Context.getTrivialTypeSourceInfo(Ty), SC_None);
       LocalTemps.push_back(TmpVar);
+      if(StmtScoped)
+	StmtTemps.push_back(TmpVar);
       return TmpVar;
     }
+    std::vector<VarDecl*> StmtTemps;
+    std::map<void*, std::vector<VarDecl*> > FreeTemps;
+    // Statement expressions yield a value after their last
+    // statement, so nothing is released inside them.
+    int StmtExprDepth;
+    void ReleaseStmtTemps(std::size_t Mark) {
+      if(StmtExprDepth > 0)
+	return;
+      for(std::size_t i = Mark; i < StmtTemps.size(); ++i)
+	FreeTemps[SemaRef.Context.getCanonicalType(StmtTemps[i]->getType()).getAsOpaquePtr()].push_back(StmtTemps[i]);
+      StmtTemps.resize(Mark);
+    }
     // Creates a typedef for arrays and other types
     // that have parts after the identifier.  Modify
     // the types in place.
@@ -1646,7 +5010,13 @@ namespace {
     //  return TransformDeclaration(D, SemaRef.CurContext);
     //}
     Decl *TransformDeclaration(Decl *D, DeclContext *DC) {
+      // The initializer of a static local is not run by the function
+      bool SavedInFunctionBody = InFunctionBody;
+      VarDecl *VD = dyn_cast<VarDecl>(D);
+      if(VD && VD->hasGlobalStorage())
+	InFunctionBody = false;
       Decl *Result = TransformDeclarationImpl(D, DC);
+      InFunctionBody = SavedInFunctionBody;
       if(Result) {
 	if(D->isImplicit())
 	  Result->setImplicit();
@@ -1720,10 +5090,29 @@ namespace {
 
       QualType Result = TL.getType();
 
+      if(Options.StaticThreads) {
+	// With a fixed number of threads this is an ordinary array
+	llvm::APInt ConstSize = T->getSize();
+	if(T->getThread()) {
+	  ConstSize *= Options.StaticThreads;
+	}
+	Result = RebuildConstantArrayType(ElementType,
+					  T->getSizeModifier(),
+					  ConstSize,
+					  T->getIndexTypeCVRQualifiers(),
+					  TL.getBracketsRange());
+
+	ArrayTypeLoc NewTL = TLB.push<ArrayTypeLoc>(Result);
+	NewTL.setLBracketLoc(TL.getLBracketLoc());
+	NewTL.setRBracketLoc(TL.getRBracketLoc());
+	NewTL.setSizeExpr(IntegerLiteral::Create(SemaRef.Context, ConstSize, SemaRef.Context.getSizeType(), SourceLocation()));
+
+	return Result;
+      }
+
       Expr *Size = IntegerLiteral::Create(SemaRef.Context, T->getSize(), SemaRef.Context.getSizeType(), SourceLocation());
       if(T->getThread()) {
-	std::vector<Expr*> args;
-	Expr *Threads = BuildUPCRCall(Decls->upcr_threads, args).get();
+	Expr *Threads = BuildUPCRThreads();
 	Size = MaybeAddParensForMultiply(Size);
 	Size = SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Mul, Size, Threads).get();
       }
@@ -1920,6 +5309,20 @@ namespace {
 	result->setParams(Parms);
 
 	if(FD->doesThisDeclarationHaveABody()) {
+	  CurForAllContext = CallGraph.getForAllContext(FD);
+	  ForAllDepth = 0;
+	  NeedsFunctionFrame = !isLeafFunction(FD);
+	  InFunctionBody = true;
+	  {
+	    CheckForModifiedDecls Check;
+	    Check.TraverseStmt(FD->getBody());
+	    FunctionAddressTaken.swap(Check.AddressTaken);
+	  }
+	  {
+	    CheckForSplitBarrier Check;
+	    Check.TraverseStmt(FD->getBody());
+	    FunctionHasSplitBarrier = Check.Found;
+	  }
 	  SemaRef.ActOnStartOfFunctionDef(0, result);
 	  Sema::SynthesizedFunctionScope Scope(SemaRef, result);
 	  Stmt *FnBody;
@@ -1927,7 +5330,7 @@ namespace {
 	    Sema::CompoundScopeRAII BodyScope(SemaRef);
 	    Stmt *UserBody = TransformStmt(FD->getBody()).get();
 	    llvm::SmallVector<Stmt*, 8> Body;
-	    {
+	    if(NeedsFunctionFrame) {
 	      std::vector<Expr*> args;
 	      Body.push_back(BuildUPCRCall(Decls->UPCR_BEGIN_FUNCTION, args, UserBody->getLocStart()).get());
 	    }
@@ -1937,9 +5340,16 @@ namespace {
 	      Body.push_back(SemaRef.ActOnDeclStmt(Sema::DeclGroupPtrTy::make(DeclGroupRef::Create(SemaRef.Context, decl_arr, 1)), SourceLocation(), SourceLocation()).get());
 	    }
 	    LocalTemps.clear();
+	    StmtTemps.clear();
+	    FreeTemps.clear();
+	    Body.append(EntryInits.begin(), EntryInits.end());
+	    EntryInits.clear();
+	    CachedThreads = CachedMyThread = NULL;
+	    CachedTLDAddrs.clear();
+	    InFunctionBody = false;
 	    // Insert the user code
 	    Body.push_back(UserBody);
-	    {
+	    if(NeedsFunctionFrame) {
 	      std::vector<Expr*> args;
 	      Body.push_back(BuildUPCRCall(Decls->UPCR_EXIT_FUNCTION, args, UserBody->getLocEnd()).get());
 	    }
@@ -1995,7 +5405,7 @@ namespace {
                                             TyInfo,
 					    VD->getStorageClass());
           if(shouldUseTLD(VD)) {
-            ThreadLocalDecls.insert(result);
+            MarkThreadLocal(result);
           }
 	  transformedLocalDecl(D, result);
           copyAttrs(D, result);
@@ -2027,7 +5437,7 @@ namespace {
 					    Ty, TyInfo,
 					    VD->getStorageClass());
           if(shouldUseTLD(VD)) {
-            ThreadLocalDecls.insert(result);
+            MarkThreadLocal(result);
           }
 	  transformedLocalDecl(D, result);
           copyAttrs(D, result);
@@ -2248,6 +5658,9 @@ namespace {
       SemaRef.setCurScope(&CurScope);
       SemaRef.PushDeclContext(&CurScope, result);
 
+      CallGraph.TraverseDecl(D);
+      CallGraph.Solve();
+
       // Process all Decls
       for(DeclContext::decl_iterator iter = D->decls_begin(),
           end = D->decls_end(); iter != end; ++iter) {
@@ -2297,15 +5710,61 @@ namespace {
       SourceLocation Loc = SrcManager.getExpansionLoc(D->getLocation());
       return Loc.isInvalid() || !SrcManager.isInSystemHeader(Loc);
     }
+    // Globals are either accessed through UPCR_TLD_ADDR, or
+    // declared __thread and accessed directly.
+    void MarkThreadLocal(VarDecl *VD) {
+      if(Options.NativeTLS)
+	VD->setTSCSpec(TSCS___thread);
+      else
+	ThreadLocalDecls.insert(VD);
+    }
     bool isUPCThreadLocal(Decl *D) {
       return ThreadLocalDecls.find(D) != ThreadLocalDecls.end();
     }
+    UPCCallGraph CallGraph;
+    // Whether upcrt_forall_control is known to be set when the
+    // current function is entered.
+    UPCCallGraph::ForAllContext CurForAllContext;
+    // Number of enclosing upc_forall bodies within the current function
+    int ForAllDepth;
+    // Whether the current function is wrapped in
+    // UPCR_BEGIN_FUNCTION and UPCR_EXIT_FUNCTION
+    bool NeedsFunctionFrame;
+    // Functions that never use the runtime, directly or through
+    // their callees, and so don't need the wrapper
+    std::map<FunctionDecl*, bool> LeafFunctions;
+    bool isLeafFunction(FunctionDecl *FD) {
+      FD = FD->getCanonicalDecl();
+      std::map<FunctionDecl*, bool>::iterator pos = LeafFunctions.find(FD);
+      if(pos != LeafFunctions.end())
+	return pos->second;
+      // Recursive calls are assumed to need it
+      LeafFunctions[FD] = false;
+      const FunctionDecl *Def;
+      if(!FD->hasBody(Def) || CallGraph.isMain(FD))
+	return false;
+      CheckForRuntimeUse Check;
+      Check.TraverseStmt(Def->getBody());
+      bool Result = !Check.Found;
+      for(std::set<VarDecl*>::const_iterator iter = Check.Globals.begin(), end = Check.Globals.end(); Result && iter != end; ++iter) {
+	if(shouldUseTLD(*iter) && !Options.NativeTLS)
+	  Result = false;
+      }
+      for(std::set<FunctionDecl*>::const_iterator iter = Check.Callees.begin(), end = Check.Callees.end(); Result && iter != end; ++iter) {
+	if(!isLeafFunction(*iter))
+	  Result = false;
+      }
+      LeafFunctions[FD] = Result;
+      return Result;
+    }
     std::set<Decl*> ThreadLocalDecls;
     std::map<Decl*, TypedefDecl*> ExtraAnonTagDecls;
+    std::map<void*, RecordDecl*> PunUnions;
     std::vector<Stmt*> SplitDecls;
     std::vector<Decl*> LocalStatics;
     UPCRDecls *Decls;
     std::string FileString;
+    UPCTransformOptions Options;
     std::vector<VarDecl*> LocalTemps;
     // The shared variables that need to be initialized
     // all must have type upcr_shared_ptr_t
@@ -2327,6 +5786,13 @@ namespace {
 	  std::vector<Expr*> args;
 	  Statements.push_back(BuildUPCRCall(Decls->UPCR_BEGIN_FUNCTION, args).get());
 	}
+	if(Options.StaticThreads) {
+	  // The layouts below are only valid for this number of threads.
+	  // See the definition of UPCRT_CHECK_THREADS in the preamble.
+	  std::vector<Expr*> args;
+	  args.push_back(CreateInteger(SemaRef.Context.IntTy, Options.StaticThreads));
+	  Statements.push_back(BuildUPCRCall(Decls->UPCRT_CHECK_THREADS, args).get());
+	}
 	int SizeTypeSize = SemaRef.Context.getTypeSize(SemaRef.Context.getSizeType());
 	QualType _bupc_info_type = SemaRef.Context.getIncompleteArrayType(Decls->upcr_startup_shalloc_t, ArrayType::Normal, 0);
 	QualType _bupc_pinfo_type = SemaRef.Context.getIncompleteArrayType(Decls->upcr_startup_pshalloc_t, ArrayType::Normal, 0);
@@ -2346,7 +5812,11 @@ namespace {
 	      ArrayDimension *= CAT->getSize();
 	    } else if(const UPCThreadArrayType *TAT = dyn_cast<UPCThreadArrayType>(AT)) {
 	      if(TAT->getThread()) {
-		hasThread = true;
+		if(Options.StaticThreads) {
+		  ArrayDimension *= Options.StaticThreads;
+		} else {
+		  hasThread = true;
+		}
 	      }
 	      ArrayDimension *= TAT->getSize();
 	    } else {
@@ -2373,6 +5843,21 @@ namespace {
 	    Initializers.push_back(BuildUPCRCall(Decls->UPCRT_STARTUP_SHALLOC, args).get());
 	  }
 	}
+	// The per-thread partial results of upc_forall reductions,
+	// each a shared [1] T[THREADS]
+	for(std::vector<std::pair<VarDecl*, QualType> >::const_iterator iter = ReductionBuffers.begin(), end = ReductionBuffers.end();
+	    iter != end; ++iter) {
+	  std::vector<Expr*> args;
+	  llvm::APInt ElementSize(SizeTypeSize, SemaRef.Context.getTypeSizeInChars(iter->second).getQuantity());
+	  args.push_back(SemaRef.BuildDeclRefExpr(iter->first, iter->first->getType(), VK_LValue, SourceLocation()).get());
+	  args.push_back(IntegerLiteral::Create(SemaRef.Context, ElementSize, SemaRef.Context.getSizeType(), SourceLocation()));
+	  args.push_back(IntegerLiteral::Create(SemaRef.Context, llvm::APInt(SizeTypeSize, 1), SemaRef.Context.getSizeType(), SourceLocation()));
+	  args.push_back(IntegerLiteral::Create(SemaRef.Context, llvm::APInt(SizeTypeSize, 1), SemaRef.Context.getSizeType(), SourceLocation()));
+	  args.push_back(IntegerLiteral::Create(SemaRef.Context, ElementSize, SemaRef.Context.getSizeType(), SourceLocation()));
+	  const char MangledType[] = "";
+	  args.push_back(StringLiteral::Create(SemaRef.Context, "", StringLiteral::Ascii, false, SemaRef.Context.getConstantArrayType(SemaRef.Context.getConstType(SemaRef.Context.CharTy), llvm::APInt(64, sizeof(MangledType)), ArrayType::Normal, 0), SourceLocation()));
+	  PInitializers.push_back(BuildUPCRCall(Decls->UPCRT_STARTUP_PSHALLOC, args).get());
+	}
 	VarDecl *_bupc_info;
 	VarDecl *_bupc_pinfo;
 	if(!Initializers.empty()) {
@@ -2478,7 +5963,7 @@ namespace {
 	    VarDecl * VD = DynamicInitializers[i].first;
 	    Expr *LHS = CreateSimpleDeclRef(VD);
 	    Expr *RHS = DynamicInitializers[i].second;
-	    if(shouldUseTLD(VD))
+	    if(isUPCThreadLocal(VD))
 	      LHS = BuildTLDRefExpr(dyn_cast<DeclRefExpr>(LHS)).get();
 	    Statements.push_back(SemaRef.CreateBuiltinBinOp(SourceLocation(), BO_Assign, LHS, RHS).get());
 	  }
@@ -2517,7 +6002,7 @@ namespace {
 
   class RemoveUPCConsumer : public clang::SemaConsumer {
   public:
-    RemoveUPCConsumer(StringRef Output, StringRef FileString, bool Lines) : filename(Output), fileid(FileString), lines(Lines) {}
+    RemoveUPCConsumer(StringRef Output, StringRef FileString, bool Lines, const UPCTransformOptions& Opts) : filename(Output), fileid(FileString), lines(Lines), options(Opts) {}
     virtual void HandleTranslationUnit(clang::ASTContext &Context) {
       if(Context.getDiagnostics().hasUncompilableErrorOccurred())
 	return;
@@ -2532,7 +6017,7 @@ namespace {
       ASTConsumer nullConsumer;
       UPCRDecls Decls(newContext);
       Sema newSema(S->getPreprocessor(), newContext, nullConsumer);
-      RemoveUPCTransform Trans(newSema, &Decls, fileid);
+      RemoveUPCTransform Trans(newSema, &Decls, fileid, options);
       Decl *Result = Trans.TransformTranslationUnitDecl(top);
       std::error_code error;
       llvm::raw_fd_ostream OS(filename.c_str(), error, llvm::sys::fs::F_None);
@@ -2563,7 +6048,43 @@ namespace {
       OS <<
 	"#define UPCRT_STARTUP_SHALLOC(sptr, blockbytes, numblocks, mult_by_threads, elemsz, typestr) \\\n"
 	"      { &(sptr), (blockbytes), (numblocks), (mult_by_threads), (elemsz), #sptr, (typestr) }\n"
-	"#define UPCRT_STARTUP_PSHALLOC UPCRT_STARTUP_SHALLOC\n"
+	"#define UPCRT_STARTUP_PSHALLOC UPCRT_STARTUP_SHALLOC\n";
+      if (Trans.HaveGather())
+        OS <<
+	  "#define UPCRT_GATHER_STRIP " << RemoveUPCTransform::GatherStripSize << "\n"
+	  "/* Gets the n elements at src into dst, with one list transfer per owning thread */\n"
+	  "static void upcrt_gather(void *dst, upcr_shared_ptr_t *src, size_t n, size_t elemsz) {\n"
+	  "  UPCR_BEGIN_FUNCTION();\n"
+	  "  upcr_thread_t owner[UPCRT_GATHER_STRIP];\n"
+	  "  void *dstlist[UPCRT_GATHER_STRIP];\n"
+	  "  upcr_shared_ptr_t srclist[UPCRT_GATHER_STRIP];\n"
+	  "  bupc_handle_t handles[UPCRT_GATHER_STRIP];\n"
+	  "  size_t i, j, first, groups = 0;\n"
+	  "  for (i = 0; i < n; i++) {\n"
+	  "    upcr_thread_t t = upcr_threadof_shared(src[i]);\n"
+	  "    for (j = i; j > 0 && owner[j-1] > t; j--) {\n"
+	  "      owner[j] = owner[j-1]; dstlist[j] = dstlist[j-1]; srclist[j] = srclist[j-1];\n"
+	  "    }\n"
+	  "    owner[j] = t; dstlist[j] = (char *)dst + i * elemsz; srclist[j] = src[i];\n"
+	  "  }\n"
+	  "  for (first = 0; first < n; first = i) {\n"
+	  "    for (i = first + 1; i < n && owner[i] == owner[first]; i++) ;\n"
+	  "    handles[groups++] = bupc_memget_ilist_async(i - first, dstlist + first, elemsz,\n"
+	  "                                                i - first, srclist + first, elemsz);\n"
+	  "  }\n"
+	  "  for (i = 0; i < groups; i++)\n"
+	  "    bupc_waitsync(handles[i]);\n"
+	  "}\n";
+      if (options.StaticThreads)
+        OS <<
+	  "#include <stdio.h>\n"
+	  "#define UPCRT_CHECK_THREADS(n) do { \\\n"
+	  "      if (upcr_threads() != (n)) { \\\n"
+	  "        if (!upcr_mythread()) \\\n"
+	  "          fprintf(stderr, \"error: compiled with -fupc-threads=%d but running with %d threads\\n\", (n), (int)upcr_threads()); \\\n"
+	  "        upcr_global_exit(1); \\\n"
+	  "      } } while (0)\n";
+      OS <<
 	"#endif\n";
 
       PrintingPolicy Policy = newContext.getPrintingPolicy();
@@ -2580,31 +6101,76 @@ namespace {
     std::string filename;
     std::string fileid;
     bool lines;
+    UPCTransformOptions options;
   };
 
   class RemoveUPCAction : public clang::ASTFrontendAction {
   public:
-    RemoveUPCAction(StringRef OutputFile, StringRef FileString, bool Lines) : filename(OutputFile), fileid(FileString), lines(Lines) {}
+    RemoveUPCAction(StringRef OutputFile, StringRef FileString, bool Lines, const UPCTransformOptions& Opts) : filename(OutputFile), fileid(FileString), lines(Lines), options(Opts) {}
     virtual std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(clang::CompilerInstance &Compiler, llvm::StringRef InFile) {
-      return std::unique_ptr<ASTConsumer>(new RemoveUPCConsumer(filename, fileid, lines));
+      return std::unique_ptr<ASTConsumer>(new RemoveUPCConsumer(filename, fileid, lines, options));
     }
     std::string filename;
     std::string fileid;
     bool lines;
+    UPCTransformOptions options;
   };
 
+  // Removes the options that are handled by the translator
+  // itself, rather than by the clang driver.
+  bool ParseTransformOption(StringRef Arg, UPCTransformOptions& Opts) {
+    if(Arg.startswith("-fupc-threads=")) {
+      // The count is emitted as an int
+      if(Arg.substr(strlen("-fupc-threads=")).getAsInteger(10, Opts.StaticThreads) || Opts.StaticThreads == 0 ||
+         Opts.StaticThreads > INT_MAX) {
+        llvm::errs() << "error: invalid thread count in '" << Arg << "'\n";
+        exit(EXIT_FAILURE);
+      }
+      return true;
+    }
+    if(Arg == "-fupc-nonblocking-gets") {
+      Opts.NonBlockingGets = true;
+      return true;
+    }
+    if(Arg == "-fupc-deferred-puts") {
+      Opts.DeferredPuts = true;
+      return true;
+    }
+    if(Arg == "-fupc-atomic-updates") {
+      Opts.AtomicUpdates = true;
+      return true;
+    }
+    if(Arg == "-fupc-elide-barriers") {
+      Opts.ElideBarriers = true;
+      return true;
+    }
+    if(Arg == "-fupc-native-tls") {
+      Opts.NativeTLS = true;
+      return true;
+    }
+    return false;
+  }
+
 }
 
 int main(int argc, const char ** argv) {
   using namespace llvm::opt;
   using namespace clang::driver;
 
+  // Strip the translator options
+  UPCTransformOptions TransOptions;
+  std::vector<const char *> Argv;
+  for(int i = 0; i < argc; ++i) {
+    if(!ParseTransformOption(argv[i], TransOptions))
+      Argv.push_back(argv[i]);
+  }
+
   // Parse the arguments
   std::unique_ptr<OptTable> Opts(createDriverOptTable());
   unsigned MissingArgIndex, MissingArgCount;
   const unsigned IncludedFlagsBitmask = options::CC1Option;
   InputArgList Args(
-      Opts->ParseArgs(llvm::makeArrayRef(argv, argc),
+      Opts->ParseArgs(Argv,
                       MissingArgIndex, MissingArgCount, IncludedFlagsBitmask));
 
   // Read the input and output files and adjust the arguments
@@ -2633,7 +6199,7 @@ int main(int argc, const char ** argv) {
   std::vector<std::string> options(NewOptions.begin(), NewOptions.end());
 
   FileManager * Files(new FileManager(FileSystemOptions()));
-  ToolInvocation tool(options, new RemoveUPCAction(OutputFile, get_file_id(InputFile), Lines), Files);
+  ToolInvocation tool(options, new RemoveUPCAction(OutputFile, get_file_id(InputFile), Lines, TransOptions), Files);
   if(tool.run()) {
     return EXIT_SUCCESS;
   } else {